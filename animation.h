@@ -0,0 +1,199 @@
+/**
+ * @file animation.h
+ * @brief Camera sequences that reuse the previous frame's samples.
+ *
+ * In a smooth camera move most of what the last frame saw is still visible. Before
+ * rendering a frame, every pixel's first hit is found and projected into the previous
+ * frame. If the previous frame saw the same surface there (similar depth and normal),
+ * its accumulated samples are carried over and the pixel only needs a few fresh ones.
+ * Pixels without usable history (disocclusions, screen edges, sky, and mirror-like or
+ * glass surfaces whose look changes with the view) get the full budget.
+ *
+ * History is looked up through pixel centers, so it is only exact for a pinhole camera
+ * (defocus_angle = 0).
+ */
+
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "common.h"
+#include "camera.h"
+#include "trace.h"
+
+#include <chrono>
+#include <vector>
+
+struct camera_pose {
+    vec3 lookfrom;
+    vec3 lookat;
+    vec3 vup;
+};
+
+class animated_camera : public camera {
+    public:
+        int min_fresh_spp = 1;           // Fresh samples every pixel gets, even with full history
+        int max_history = 256;           // Samples of history kept per pixel, older ones fade out beyond that
+        double depth_tolerance = 0.02;   // Relative depth difference that counts as a different surface
+        double normal_tolerance = 0.9;   // Smallest cosine between normals of the same surface
+
+        // Render the frame seen from pose into out, reusing whatever the previous call accumulated
+        void render_frame(const hittable& world, const camera_pose& pose, std::ostream& out) {
+            trace_span span("frame", "animation");
+            lookfrom = pose.lookfrom;
+            lookat = pose.lookat;
+            vup = pose.vup;
+            initialize();
+
+            auto start = std::chrono::steady_clock::now();
+
+            find_first_hits(world);
+            int reused = has_history ? reproject() : 0;
+
+            // Top every pixel up to samples_per_pixel, history counts toward it
+            pixel_budget.assign(pixels.size(), 0);
+            long fresh = 0;
+            for (std::size_t p = 0; p < pixels.size(); p++) {
+                pixel_budget[p] = std::max(min_fresh_spp, samples_per_pixel - pixel_counts[p]);
+                fresh += pixel_budget[p];
+            }
+            render_tiles(world, 0);
+            pixel_budget.clear();
+
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            write_image(out);
+
+            if (show_progress) {
+                std::clog << "\nFrame: " << seconds << " s, history reused in "
+                          << 100.0 * reused / pixels.size() << "% of pixels, "
+                          << fresh << " fresh samples (" << 100.0 * fresh / (double(pixels.size()) * samples_per_pixel)
+                          << "% of a full render)\n";
+            }
+
+            keep_history();
+        }
+
+        // Forget the previous frame, e.g. after a cut
+        void reset_history() {
+            has_history = false;
+        }
+
+    private:
+        // What is needed to project a point into a frame
+        struct view {
+            vec3 center;
+            vec3 w;
+            vec3 pixel00_loc;
+            vec3 pixel_delta_u;
+            vec3 pixel_delta_v;
+            double focus_dist;
+            int width;
+            int height;
+        };
+
+        // First hit through each pixel center of the current frame, distance is infinity for
+        // misses and for view-dependent surfaces
+        std::vector<double> hit_distance;
+        std::vector<vec3> hit_point;
+        std::vector<vec3> hit_normal;
+
+        bool has_history = false;
+        view prev_view;
+        std::vector<color> prev_sum;
+        std::vector<double> prev_lum_sq;
+        std::vector<int> prev_count;
+        std::vector<double> prev_distance;
+        std::vector<vec3> prev_normal;
+
+        view current_view() const {
+            return view{ center, w, pixel00_loc, pixel_delta_u, pixel_delta_v, focus_dist, image_width, image_height };
+        }
+
+        void find_first_hits(const hittable& world) {
+            trace_span span("first hits", "animation");
+            std::size_t count = pixels.size();
+            hit_distance.assign(count, infinity);
+            hit_point.assign(count, vec3());
+            hit_normal.assign(count, vec3());
+
+            for (int j = 0; j < image_height; j++) {
+                for (int i = 0; i < image_width; i++) {
+                    vec3 direction = unit_vector(pixel00_loc + i * pixel_delta_u + j * pixel_delta_v - center);
+                    hit_record rec;
+                    ray r(center, direction);
+                    if (world.hit(r, interval(0.001, infinity), rec)) {
+                        // Only diffuse surfaces look the same from everywhere. Materials that can't
+                        // give a scattering pdf (metal, glass) are treated as having no history.
+                        if (rec.mat->scattering_pdf(r, rec, ray(rec.p, rec.normal)) <= 0) {
+                            continue;
+                        }
+                        std::size_t p = j * image_width + i;
+                        hit_distance[p] = rec.t;
+                        hit_point[p] = rec.p;
+                        hit_normal[p] = rec.normal;
+                    }
+                }
+            }
+        }
+
+        // Pull valid history into the framebuffer, returns how many pixels got some
+        int reproject() {
+            trace_span span("reproject", "animation");
+            const view& prev = prev_view;
+            if (prev.width != image_width || prev.height != image_height) {
+                return 0;
+            }
+
+            double du2 = prev.pixel_delta_u.length_squared();
+            double dv2 = prev.pixel_delta_v.length_squared();
+            int reused = 0;
+
+            for (std::size_t p = 0; p < pixels.size(); p++) {
+                if (hit_distance[p] == infinity) {
+                    continue;
+                }
+
+                // Project the hit point onto the previous frame's viewport plane
+                vec3 d = hit_point[p] - prev.center;
+                double along = -dot(d, prev.w);
+                if (along <= 0) {
+                    continue; // behind the previous camera
+                }
+                vec3 rel = prev.center + d * (prev.focus_dist / along) - prev.pixel00_loc;
+                int i = (int)std::floor(dot(rel, prev.pixel_delta_u) / du2 + 0.5);
+                int j = (int)std::floor(dot(rel, prev.pixel_delta_v) / dv2 + 0.5);
+                if (i < 0 || i >= prev.width || j < 0 || j >= prev.height) {
+                    continue;
+                }
+
+                // Same surface? The previous frame must have seen this point at the same
+                // distance (otherwise something was in front of it) with a similar normal
+                std::size_t k = j * prev.width + i;
+                double expected = prev_distance[k];
+                if (prev_count[k] == 0 || expected == infinity
+                    || fabs(d.length() - expected) > depth_tolerance * expected
+                    || dot(hit_normal[p], prev_normal[k]) < normal_tolerance) {
+                    continue;
+                }
+
+                double keep = prev_count[k] > max_history ? double(max_history) / prev_count[k] : 1.0;
+                pixels[p] = keep * prev_sum[k];
+                pixel_lum_sq[p] = keep * prev_lum_sq[k];
+                pixel_counts[p] = std::min(prev_count[k], max_history);
+                reused++;
+            }
+
+            return reused;
+        }
+
+        void keep_history() {
+            prev_view = current_view();
+            prev_sum = pixels;
+            prev_lum_sq = pixel_lum_sq;
+            prev_count = pixel_counts;
+            prev_distance.swap(hit_distance);
+            prev_normal.swap(hit_normal);
+            has_history = true;
+        }
+};
+
+#endif
@@ -0,0 +1,232 @@
+/**
+ * @file autotune.h
+ * @brief Pick tile size, thread count and BVH leaf size by timing short test renders.
+ *
+ * The best values depend on both the machine and the scene, so the winner is stored
+ * in a small text file under a machine fingerprint and a scene fingerprint. Later
+ * renders of the same scene on the same machine look it up and use it directly.
+ *
+ * File format, one line per machine and scene:
+ *   <machine> <scene> tile=<n> threads=<n> leaf=<n>
+ */
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "common.h"
+#include "camera.h"
+#include "bvh.h"
+#include "bvh_cache.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+struct render_config {
+    int tile_size = 16;
+    int thread_count = 0;
+    int leaf_size = 2;
+};
+
+class autotuner {
+    public:
+        double budget_seconds = 30.0; // Stop trying new candidates after this long
+        int calibration_spp = 1;      // Samples per pixel of each test render
+        int guided_calibration_spp = 3; // Same with a guide: a 1 spp training pass, then a 2 spp pass that samples from it
+
+        explicit autotuner(const std::string& path) : path(path) {}
+
+        // Hostname, core count and CPU model, hashed
+        static std::string machine_fingerprint() {
+            std::string description;
+
+            char host[256] = {};
+            if (gethostname(host, sizeof(host) - 1) == 0) {
+                description += host;
+            }
+            description += "/" + std::to_string(std::thread::hardware_concurrency());
+
+            std::ifstream cpuinfo("/proc/cpuinfo");
+            std::string line;
+            while (std::getline(cpuinfo, line)) {
+                if (line.compare(0, 10, "model name") == 0) {
+                    description += "/" + line;
+                    break;
+                }
+            }
+
+            return hex(fnv1a(description.data(), description.size()));
+        }
+
+        // Geometry plus the camera settings that change the amount of work per tile,
+        // including the switches that change the cost of every sample (guiding, environment light)
+        static std::string scene_fingerprint(const hittable_list& list, const camera& cam) {
+            std::uint64_t hash = scene_hash(list);
+            int settings[6] = { cam.image_width, cam.samples_per_pixel, cam.max_depth,
+                                cam.guide != nullptr, cam.environment != nullptr,
+                                cam.environment != nullptr && cam.environment_sampling };
+            double aspect = cam.aspect_ratio;
+            hash = fnv1a(settings, sizeof(settings), hash);
+            hash = fnv1a(&aspect, sizeof(aspect), hash);
+            return hex(hash);
+        }
+
+        // Stored configuration for this machine and scene, if there is one
+        bool lookup(const std::string& scene, render_config& config) const {
+            std::ifstream in(path);
+            std::string line;
+            std::string machine = machine_fingerprint();
+
+            while (std::getline(in, line)) {
+                std::istringstream fields(line);
+                std::string m, s;
+                render_config c;
+                if (!(fields >> m >> s) || m != machine || s != scene) {
+                    continue;
+                }
+                if (std::sscanf(line.c_str() + m.size() + s.size() + 2, "tile=%d threads=%d leaf=%d",
+                                &c.tile_size, &c.thread_count, &c.leaf_size) == 3
+                    && c.tile_size > 0 && c.thread_count >= 0 && c.leaf_size > 0) {
+                    config = c;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Replace (or add) this machine and scene's line in the file
+        bool store(const std::string& scene, const render_config& config) const {
+            std::string machine = machine_fingerprint();
+            std::vector<std::string> kept;
+            {
+                std::ifstream in(path);
+                std::string line;
+                while (std::getline(in, line)) {
+                    if (line.compare(0, machine.size() + 1 + scene.size(), machine + " " + scene) != 0) {
+                        kept.push_back(line);
+                    }
+                }
+            }
+
+            // Write to a temporary name and rename, so a crash or a concurrent run never
+            // leaves the other machines' and scenes' lines half written or lost
+            std::string temp = path + ".tmp" + std::to_string(getpid());
+            bool ok;
+            {
+                std::ofstream out(temp, std::ios::trunc);
+                for (const auto& line : kept) {
+                    out << line << "\n";
+                }
+                out << machine << " " << scene << " tile=" << config.tile_size
+                    << " threads=" << config.thread_count << " leaf=" << config.leaf_size << "\n";
+                out.close();
+                ok = (bool)out;
+            }
+
+            if (!ok || std::rename(temp.c_str(), path.c_str()) != 0) {
+                std::remove(temp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        // Time a test render of every candidate and return the fastest
+        render_config tune(const hittable_list& list, const camera& base) {
+            trace_span span("autotune", "autotune");
+
+            int cores = std::max(1, (int)std::thread::hardware_concurrency());
+            std::vector<int> thread_counts = { cores };
+            if (cores > 1) thread_counts.push_back(cores / 2);
+            if (cores > 2) thread_counts.push_back(1);
+            if (cores > 1) thread_counts.push_back(2 * cores); // oversubscribing hides stalls sometimes
+
+            const int tile_sizes[] = { 8, 16, 32, 64 };
+            const int leaf_sizes[] = { 1, 2, 4, 8 };
+
+            auto start = std::chrono::steady_clock::now();
+            render_config best;
+            double best_seconds = infinity;
+            int tried = 0;
+
+            for (int leaf : leaf_sizes) {
+                bvh world(list, leaf);
+                for (int threads : thread_counts) {
+                    for (int tile : tile_sizes) {
+                        if (elapsed(start) > budget_seconds && tried > 0) {
+                            std::clog << "Autotune: budget used up after " << tried << " candidates\n";
+                            return best;
+                        }
+
+                        render_config candidate;
+                        candidate.tile_size = tile;
+                        candidate.thread_count = threads;
+                        candidate.leaf_size = leaf;
+
+                        // Best of two, the first run also warms the caches
+                        double seconds = std::min(time_render(world, base, candidate),
+                                                  time_render(world, base, candidate));
+                        tried++;
+
+                        std::clog << "Autotune: tile " << tile << ", threads " << threads
+                                  << ", leaf " << leaf << ": " << seconds * 1000 << " ms\n";
+                        if (seconds < best_seconds) {
+                            best_seconds = seconds;
+                            best = candidate;
+                        }
+                    }
+                }
+            }
+
+            return best;
+        }
+
+        static void apply(const render_config& config, camera& cam) {
+            cam.tile_size = config.tile_size;
+            cam.thread_count = config.thread_count;
+        }
+
+    private:
+        std::string path;
+
+        static std::string hex(std::uint64_t value) {
+            char text[17];
+            std::snprintf(text, sizeof(text), "%016llx", (unsigned long long)value);
+            return text;
+        }
+
+        static double elapsed(std::chrono::steady_clock::time_point start) {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        double time_render(const hittable& world, const camera& base, const render_config& config) const {
+            trace_span span("calibration render", "autotune");
+            span.arg("tile", config.tile_size);
+            span.arg("threads", config.thread_count);
+            span.arg("leaf", config.leaf_size);
+
+            camera cam = base;
+            apply(config, cam);
+            cam.pool = nullptr; // a pool of the candidate's size is started for this render
+            cam.samples_per_pixel = base.guide ? std::max(calibration_spp, guided_calibration_spp) : calibration_spp;
+            cam.show_progress = false;
+            if (base.guide) {
+                // A fresh guide per test render, so they all pay for the same training
+                cam.guide = make_shared<path_guide>(world.bounding_box());
+            }
+
+            std::ostringstream discard;
+            auto start = std::chrono::steady_clock::now();
+            cam.render(world, discard);
+            return elapsed(start);
+        }
+};
+
+#endif
@@ -0,0 +1,215 @@
+/**
+ * @file bvh.h
+ * @brief Bounding volume hierarchy over the objects of a hittable_list.
+ * Instead of testing a ray against every object, the objects are grouped into a
+ * tree of boxes and whole subtrees are skipped when the ray misses their box.
+ *
+ * The tree is stored flat: an array of nodes that refer to each other by index and
+ * an array of object indices for the leaves. There are no pointers in it, so it can
+ * be written to disk and mapped back in as-is (see bvh_cache.h).
+ */
+
+#ifndef BVH_H
+#define BVH_H
+
+#include "common.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// One node of the flat tree, 64 bytes and aligned to 64 so a node never straddles two cache lines
+struct alignas(64) bvh_node {
+    double bounds_min[3];
+    double bounds_max[3];
+    std::uint32_t offset; // leaf: first entry in the index array, interior: index of the second child
+    std::uint32_t count;  // number of objects in a leaf, 0 for an interior node
+    std::uint32_t axis;   // axis the children were split on (interior nodes)
+    std::uint32_t pad;    // keeps the layout the same on every compiler
+};
+// The first child of an interior node is always the node right after it.
+static_assert(sizeof(bvh_node) == 64, "bvh_node is written to disk as-is");
+
+class bvh : public hittable {
+    public:
+        // Entries in the traversal stack. A tree of depth d needs d + 1 of them, and median
+        // splits keep built trees far below that, but trees read from disk are checked against it.
+        static const int stack_size = 64;
+
+        // Build a new tree, leaves hold at most max_leaf_size objects
+        bvh(const hittable_list& list, int max_leaf_size = 2)
+            : objects(list.objects), leaf_size(std::max(1, max_leaf_size)), bbox(list.bounding_box()) {
+            trace_span span("bvh build", "scene");
+            span.arg("objects", (std::int64_t)objects.size());
+
+            owned_indices.resize(objects.size());
+            for (std::size_t i = 0; i < objects.size(); i++) {
+                owned_indices[i] = (std::uint32_t)i;
+            }
+
+            if (!objects.empty()) {
+                std::vector<aabb> boxes;
+                boxes.reserve(objects.size());
+                for (const auto& object : objects) {
+                    boxes.push_back(object->bounding_box());
+                }
+                owned_nodes.reserve(2 * objects.size());
+                build(boxes, 0, (std::uint32_t)objects.size());
+            }
+
+            nodes = owned_nodes.data();
+            node_count = owned_nodes.size();
+            indices = owned_indices.data();
+            index_count = owned_indices.size();
+        }
+
+        // Wrap an already built tree that lives in storage (e.g. a mapped cache file).
+        // The arrays must have been built for exactly these objects.
+        bvh(const hittable_list& list, int max_leaf_size,
+            const bvh_node* nodes, std::size_t node_count,
+            const std::uint32_t* indices, std::size_t index_count,
+            shared_ptr<const void> storage)
+            : objects(list.objects), leaf_size(max_leaf_size), bbox(list.bounding_box()),
+              storage(storage), nodes(nodes), node_count(node_count),
+              indices(indices), index_count(index_count) {}
+
+        // nodes and indices may point into this object's own arrays, a copy would dangle
+        bvh(const bvh&) = delete;
+        bvh& operator=(const bvh&) = delete;
+
+        bool intersect(const ray& r, interval ray_t, hit_query& q) const override {
+            if (node_count == 0) {
+                return false;
+            }
+
+            const vec3& dir = r.direction();
+            vec3 inv_dir(1.0 / dir[0], 1.0 / dir[1], 1.0 / dir[2]);
+            bool hit_anything = false;
+
+            // Depth first, always visiting the child nearer to the ray first so
+            // ray_t.max shrinks early and more far boxes get culled
+            std::uint32_t stack[stack_size];
+            int top = 0;
+            stack[top++] = 0;
+
+            while (top > 0) {
+                const bvh_node& node = nodes[stack[--top]];
+                if (!node_hit(node, r.origin(), inv_dir, ray_t)) {
+                    continue;
+                }
+
+                if (node.count > 0) {
+                    for (std::uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                        if (objects[indices[i]]->intersect(r, ray_t, q)) {
+                            hit_anything = true;
+                            ray_t.max = q.t;
+                        }
+                    }
+                    continue;
+                }
+
+                std::uint32_t first = (std::uint32_t)(&node - nodes) + 1;
+                std::uint32_t second = node.offset;
+                if (dir[node.axis] < 0) {
+                    std::swap(first, second);
+                }
+                stack[top++] = second; // pushed first so it is popped last
+                stack[top++] = first;
+            }
+
+            return hit_anything;
+        }
+
+        void interact(const ray& r, const hit_query& q, hit_record& rec) const override {
+            // intersect() only ever reports the objects themselves
+            q.object->interact(r, q, rec);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        // Raw access to the flat arrays, for writing the tree to disk
+        int max_leaf_size() const { return leaf_size; }
+        const bvh_node* node_data() const { return nodes; }
+        std::size_t nodes_size() const { return node_count; }
+        const std::uint32_t* index_data() const { return indices; }
+        std::size_t indices_size() const { return index_count; }
+
+    private:
+        std::vector<shared_ptr<hittable>> objects;
+        int leaf_size;
+        aabb bbox;
+
+        // Either the tree was built here and lives in owned_*, or it lives in storage
+        std::vector<bvh_node> owned_nodes;
+        std::vector<std::uint32_t> owned_indices;
+        shared_ptr<const void> storage;
+
+        const bvh_node* nodes = nullptr;
+        std::size_t node_count = 0;
+        const std::uint32_t* indices = nullptr;
+        std::size_t index_count = 0;
+
+        static bool node_hit(const bvh_node& node, const vec3& orig, const vec3& inv_dir, interval ray_t) {
+            for (int axis = 0; axis < 3; axis++) {
+                auto t0 = (node.bounds_min[axis] - orig[axis]) * inv_dir[axis];
+                auto t1 = (node.bounds_max[axis] - orig[axis]) * inv_dir[axis];
+
+                if (t0 > t1) std::swap(t0, t1);
+                if (t0 > ray_t.min) ray_t.min = t0;
+                if (t1 < ray_t.max) ray_t.max = t1;
+
+                if (ray_t.max <= ray_t.min) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Build the subtree for owned_indices[begin, end) and return its node index
+        std::uint32_t build(const std::vector<aabb>& boxes, std::uint32_t begin, std::uint32_t end) {
+            std::uint32_t index = (std::uint32_t)owned_nodes.size();
+            owned_nodes.push_back(bvh_node());
+
+            aabb bounds;
+            aabb centroids;
+            for (std::uint32_t i = begin; i < end; i++) {
+                const aabb& box = boxes[owned_indices[i]];
+                bounds = aabb(bounds, box);
+                vec3 c = box.centroid();
+                centroids = aabb(centroids, aabb(c, c));
+            }
+
+            bvh_node node = {};
+            for (int axis = 0; axis < 3; axis++) {
+                node.bounds_min[axis] = bounds.axis_interval(axis).min;
+                node.bounds_max[axis] = bounds.axis_interval(axis).max;
+            }
+
+            std::uint32_t count = end - begin;
+            if (count <= (std::uint32_t)leaf_size) {
+                node.offset = begin;
+                node.count = count;
+                owned_nodes[index] = node;
+                return index;
+            }
+
+            // Split at the median centroid along the axis where the centroids spread the most
+            int axis = centroids.longest_axis();
+            std::uint32_t mid = begin + count / 2;
+            std::nth_element(owned_indices.begin() + begin, owned_indices.begin() + mid, owned_indices.begin() + end,
+                [&](std::uint32_t a, std::uint32_t b) {
+                    return boxes[a].axis_interval(axis).min + boxes[a].axis_interval(axis).max
+                         < boxes[b].axis_interval(axis).min + boxes[b].axis_interval(axis).max;
+                });
+
+            build(boxes, begin, mid);
+            node.offset = build(boxes, mid, end);
+            node.count = 0;
+            node.axis = (std::uint32_t)axis;
+            owned_nodes[index] = node;
+            return index;
+        }
+};
+
+#endif
@@ -0,0 +1,242 @@
+/**
+ * @file bvh_cache.h
+ * @brief On-disk cache of built BVHs.
+ * A tree is only a function of the object bounding boxes (and the leaf size), so the
+ * boxes are hashed into a key and the flat tree is stored under it. Later runs of the
+ * same scene map the file and use the nodes straight from the page cache instead of
+ * rebuilding. Any mismatch or damage just means a fresh build.
+ *
+ * File layout (host byte order):
+ *   bvh_cache_header | bvh_node[node_count] | uint32_t[index_count]
+ */
+
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "common.h"
+#include "bvh.h"
+#include "trace.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct bvh_cache_header {
+    char magic[8];              // "RTBVH\0\0\0"
+    std::uint32_t version;      // bumped whenever bvh_node or the layout changes
+    std::uint32_t endian_check; // 0x01020304 when written, anything else is a foreign byte order
+    std::uint64_t scene_hash;
+    std::uint32_t max_leaf_size;
+    std::uint32_t object_count;
+    std::uint64_t node_count;
+    std::uint64_t index_count;
+    std::uint64_t checksum;     // FNV-1a over everything after the header
+    std::uint8_t reserved[8];   // pads the header to 64 bytes, so the nodes after it stay cache line aligned
+};
+static_assert(sizeof(bvh_cache_header) == 64, "nodes must start on a cache line boundary");
+
+// 64-bit FNV-1a, small and good enough to tell scenes and damaged files apart
+inline std::uint64_t fnv1a(const void* data, std::size_t size, std::uint64_t hash = 14695981039346656037ull) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Hash of everything a BVH build depends on: the object count and the boxes, in order
+inline std::uint64_t scene_hash(const hittable_list& list) {
+    std::uint64_t count = list.objects.size();
+    std::uint64_t hash = fnv1a(&count, sizeof(count));
+    for (const auto& object : list.objects) {
+        aabb box = object->bounding_box();
+        double extents[6] = { box.x.min, box.x.max, box.y.min, box.y.max, box.z.min, box.z.max };
+        hash = fnv1a(extents, sizeof(extents), hash);
+    }
+    return hash;
+}
+
+class bvh_cache {
+    public:
+        static const std::uint32_t format_version = 2;
+
+        explicit bvh_cache(const std::string& directory) : directory(directory) {}
+
+        // Map the cached tree for list if there is a valid one, otherwise build and store it
+        shared_ptr<bvh> load_or_build(const hittable_list& list, int max_leaf_size = 2) {
+            std::uint64_t hash = scene_hash(list);
+            std::string path = path_for(hash, max_leaf_size);
+
+            auto cached = load(path, list, hash, max_leaf_size);
+            if (cached) {
+                std::clog << "BVH cache: loaded " << path << "\n";
+                return cached;
+            }
+
+            auto built = make_shared<bvh>(list, max_leaf_size);
+            if (store(path, *built, hash, (std::uint32_t)list.objects.size())) {
+                std::clog << "BVH cache: stored " << path << "\n";
+            } else {
+                std::clog << "BVH cache: could not write " << path << "\n";
+            }
+            return built;
+        }
+
+        // The cached tree for list if there is a valid one, nullptr otherwise
+        shared_ptr<bvh> load(const hittable_list& list, int max_leaf_size = 2) const {
+            std::uint64_t hash = scene_hash(list);
+            return load(path_for(hash, max_leaf_size), list, hash, max_leaf_size);
+        }
+
+        // Where the tree for list is stored
+        std::string path_for(const hittable_list& list, int max_leaf_size = 2) const {
+            return path_for(scene_hash(list), max_leaf_size);
+        }
+
+    private:
+        std::string directory;
+
+        // A read-only mapping of a whole file, unmapped when the last bvh using it goes away
+        struct mapped_file {
+            void* data = MAP_FAILED;
+            std::size_t size = 0;
+
+            ~mapped_file() {
+                if (data != MAP_FAILED) {
+                    munmap(data, size);
+                }
+            }
+        };
+
+        std::string path_for(std::uint64_t hash, int max_leaf_size) const {
+            char name[64];
+            std::snprintf(name, sizeof(name), "/%016llx-l%d.bvh", (unsigned long long)hash, max_leaf_size);
+            return directory + name;
+        }
+
+        static shared_ptr<bvh> load(const std::string& path, const hittable_list& list,
+                                    std::uint64_t hash, int max_leaf_size) {
+            trace_span span("bvh cache load", "scene");
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return nullptr; // nothing cached yet
+            }
+
+            struct stat st;
+            auto file = make_shared<mapped_file>();
+            if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(bvh_cache_header)) {
+                file->size = (std::size_t)st.st_size;
+                file->data = mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            close(fd); // the mapping stays valid without the descriptor
+
+            if (file->data == MAP_FAILED) {
+                std::clog << "BVH cache: " << path << " unreadable, rebuilding\n";
+                return nullptr;
+            }
+
+            const char* base = static_cast<const char*>(file->data);
+            bvh_cache_header header;
+            std::memcpy(&header, base, sizeof(header));
+
+            const char* reason = nullptr;
+            if (std::memcmp(header.magic, "RTBVH\0\0\0", 8) != 0) {
+                reason = "bad magic";
+            } else if (header.version != format_version || header.endian_check != 0x01020304) {
+                reason = "written by an incompatible version";
+            } else if (header.scene_hash != hash || header.max_leaf_size != (std::uint32_t)max_leaf_size
+                       || header.object_count != list.objects.size()) {
+                reason = "built for a different scene";
+            } else if (header.index_count != list.objects.size() || header.node_count > 2 * header.index_count
+                       || file->size != sizeof(header) + header.node_count * sizeof(bvh_node)
+                                                       + header.index_count * sizeof(std::uint32_t)) {
+                reason = "truncated";
+            } else if (fnv1a(base + sizeof(header), file->size - sizeof(header)) != header.checksum) {
+                reason = "checksum mismatch";
+            }
+
+            auto nodes = reinterpret_cast<const bvh_node*>(base + sizeof(header));
+            auto indices = reinterpret_cast<const std::uint32_t*>(nodes + (reason ? 0 : header.node_count));
+            if (!reason && !well_formed(nodes, header.node_count, indices, header.index_count)) {
+                reason = "malformed tree";
+            }
+
+            if (reason) {
+                std::clog << "BVH cache: " << path << " " << reason << ", rebuilding\n";
+                return nullptr;
+            }
+
+            return make_shared<bvh>(list, max_leaf_size, nodes, header.node_count,
+                                    indices, header.index_count, file);
+        }
+
+        // A passing checksum doesn't guarantee the file was produced by us, so make sure
+        // traversal can never index outside the arrays, its stack included
+        static bool well_formed(const bvh_node* nodes, std::uint64_t node_count,
+                                const std::uint32_t* indices, std::uint64_t index_count) {
+            // Children always come after their parent, so one forward pass finds the deepest
+            // path to every node
+            std::vector<int> depth(node_count, 0);
+            for (std::uint64_t i = 0; i < node_count; i++) {
+                const bvh_node& node = nodes[i];
+                if (node.count > 0) {
+                    if ((std::uint64_t)node.offset + node.count > index_count) return false;
+                } else if (node.offset <= i || node.offset >= node_count || i + 1 >= node_count || node.axis > 2) {
+                    return false;
+                } else {
+                    // The stack holds one pending sibling per level above plus both children
+                    if (depth[i] + 2 > bvh::stack_size) return false;
+                    depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+                    depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+                }
+            }
+            for (std::uint64_t i = 0; i < index_count; i++) {
+                if (indices[i] >= index_count) return false;
+            }
+            return true;
+        }
+
+        static bool store(const std::string& path, const bvh& tree, std::uint64_t hash, std::uint32_t object_count) {
+            bvh_cache_header header = {};
+            std::memcpy(header.magic, "RTBVH\0\0\0", 8);
+            header.version = format_version;
+            header.endian_check = 0x01020304;
+            header.scene_hash = hash;
+            header.max_leaf_size = (std::uint32_t)tree.max_leaf_size();
+            header.object_count = object_count;
+            header.node_count = tree.nodes_size();
+            header.index_count = tree.indices_size();
+
+            std::size_t node_bytes = tree.nodes_size() * sizeof(bvh_node);
+            std::size_t index_bytes = tree.indices_size() * sizeof(std::uint32_t);
+            header.checksum = fnv1a(tree.index_data(), index_bytes, fnv1a(tree.node_data(), node_bytes));
+
+            // Write to a temporary name and rename, so a crash or a concurrent run never
+            // leaves a half-written file under the real name
+            std::string temp = path + ".tmp" + std::to_string(getpid());
+            std::FILE* f = std::fopen(temp.c_str(), "wb");
+            if (!f) {
+                return false;
+            }
+            bool ok = std::fwrite(&header, sizeof(header), 1, f) == 1
+                   && (node_bytes == 0 || std::fwrite(tree.node_data(), node_bytes, 1, f) == 1)
+                   && (index_bytes == 0 || std::fwrite(tree.index_data(), index_bytes, 1, f) == 1);
+            ok = (std::fclose(f) == 0) && ok;
+
+            if (!ok || std::rename(temp.c_str(), path.c_str()) != 0) {
+                std::remove(temp.c_str());
+                return false;
+            }
+            return true;
+        }
+};
+
+#endif
@@ -0,0 +1,262 @@
+/**
+ * Checks for the on-disk formats (bvh_cache.h, paged_geometry.h): a tree or scene written
+ * and read back must behave like the original, and damaged or foreign files must be
+ * turned away instead of being used.
+ *
+ *   g++ -std=c++17 -O2 -pthread cache_check.cpp -o cache_check && ./cache_check
+ *
+ * Prints one line per failed check and exits with 1 if there was any.
+ */
+
+#include "common.h"
+#include "bvh.h"
+#include "bvh_cache.h"
+#include "paged_geometry.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+static bool throws(const std::function<void()>& f) {
+    try {
+        f();
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+static std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static void write_file(const std::string& path, const std::string& bytes) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), bytes.size());
+}
+
+// Same closest hit (object and t) for a bunch of random rays
+static bool same_hits(const hittable& a, const hittable& b) {
+    for (int i = 0; i < 2000; i++) {
+        ray r(vec3(random_double(-20, 20), random_double(-2, 5), random_double(-20, 20)),
+              vec3(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1)));
+        hit_record ra, rb;
+        bool ha = a.hit(r, interval(0.001, infinity), ra);
+        bool hb = b.hit(r, interval(0.001, infinity), rb);
+        if (ha != hb || (ha && (fabs(ra.t - rb.t) > 1e-9 || ra.mat != rb.mat))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void check_bvh_cache(const std::string& dir) {
+    hittable_list list;
+    auto mat = make_shared<diffuse>(color(0.5, 0.5, 0.5));
+    for (int i = 0; i < 200; i++) {
+        list.add(make_shared<sphere>(vec3(random_double(-15, 15), random_double(0, 3), random_double(-15, 15)),
+                                     random_double(0.1, 1), mat));
+    }
+
+    bvh_cache cache(dir);
+    std::string path = cache.path_for(list);
+
+    check(!cache.load(list), "bvh cache: nothing is loaded before anything was stored");
+    auto built = cache.load_or_build(list);
+    auto loaded = cache.load(list);
+    check(loaded != nullptr, "bvh cache: a stored tree loads back");
+    if (loaded) {
+        check(loaded->nodes_size() == built->nodes_size()
+              && std::memcmp(loaded->node_data(), built->node_data(), built->nodes_size() * sizeof(bvh_node)) == 0,
+              "bvh cache: loaded nodes match the built ones");
+        check(same_hits(*loaded, list), "bvh cache: loaded tree finds the same hits as the plain list");
+    }
+    check(!cache.load(list, 4), "bvh cache: a tree with another leaf size is not used");
+
+    std::string good = read_file(path);
+    auto rejected = [&](std::string bytes, const std::string& what) {
+        write_file(path, bytes);
+        check(!cache.load(list), "bvh cache: " + what + " is rejected");
+    };
+
+    rejected(good.substr(0, good.size() - 1), "a truncated file");
+    rejected(good.substr(0, sizeof(bvh_cache_header) / 2), "a file shorter than the header");
+    rejected("", "an empty file");
+
+    std::string flipped = good;
+    flipped[sizeof(bvh_cache_header) + 3] ^= 0x40;
+    rejected(flipped, "a flipped node byte");
+
+    std::string version = good;
+    std::uint32_t other = bvh_cache::format_version + 1;
+    std::memcpy(&version[offsetof(bvh_cache_header, version)], &other, sizeof(other));
+    rejected(version, "another format version");
+
+    std::string foreign = good;
+    foreign[0] = 'X';
+    rejected(foreign, "a file with the wrong magic");
+
+    hittable_list other_scene = list;
+    other_scene.add(make_shared<sphere>(vec3(0, 10, 0), 1, mat));
+    write_file(cache.path_for(other_scene), good);
+    check(!cache.load(other_scene), "bvh cache: a tree built for another scene is rejected");
+
+    // A chain deeper than the traversal stack, with a valid checksum
+    {
+        std::uint32_t n = (std::uint32_t)list.objects.size();
+        std::uint32_t depth = bvh::stack_size + 2;
+        std::vector<bvh_node> nodes;
+        bvh_node everywhere = {};
+        for (int axis = 0; axis < 3; axis++) {
+            everywhere.bounds_min[axis] = -1e9;
+            everywhere.bounds_max[axis] = 1e9;
+        }
+        for (std::uint32_t k = 0; k < depth; k++) {
+            bvh_node node = everywhere;
+            node.offset = depth + 1 + k; // second child: a leaf after the chain
+            nodes.push_back(node);
+        }
+        for (std::uint32_t k = 0; k <= depth; k++) {
+            bvh_node leaf = everywhere;
+            leaf.count = 1;
+            leaf.offset = k;
+            nodes.push_back(leaf);
+        }
+        std::vector<std::uint32_t> indices(n);
+        for (std::uint32_t i = 0; i < n; i++) indices[i] = i;
+
+        bvh_cache_header header;
+        std::memcpy(&header, good.data(), sizeof(header));
+        header.node_count = nodes.size();
+        header.checksum = fnv1a(indices.data(), indices.size() * sizeof(std::uint32_t),
+                                fnv1a(nodes.data(), nodes.size() * sizeof(bvh_node)));
+        std::string bytes(reinterpret_cast<const char*>(&header), sizeof(header));
+        bytes.append(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(bvh_node));
+        bytes.append(reinterpret_cast<const char*>(indices.data()), indices.size() * sizeof(std::uint32_t));
+        rejected(bytes, "a tree deeper than the traversal stack");
+    }
+
+    // After all that, load_or_build replaces the damaged file with a good one
+    cache.load_or_build(list);
+    check(cache.load(list) != nullptr, "bvh cache: a damaged file is replaced by the next build");
+}
+
+static void check_paged_scene(const std::string& dir) {
+    std::vector<shared_ptr<material>> palette = {
+        make_shared<diffuse>(color(0.5, 0.5, 0.5)),
+        make_shared<diffuse>(color(0.7, 0.2, 0.2)),
+    };
+
+    std::vector<paged_sphere> spheres;
+    hittable_list list;
+    spheres.push_back(paged_sphere{ { 0, -1000, 0 }, 1000, 0, 0 });
+    for (int i = 0; i < 500; i++) {
+        spheres.push_back(paged_sphere{ { random_double(-15, 15), 0.2, random_double(-15, 15) }, 0.2, 1, 0 });
+    }
+    for (const auto& s : spheres) {
+        list.add(make_shared<sphere>(vec3(s.center[0], s.center[1], s.center[2]), s.radius, palette[s.material]));
+    }
+
+    paged_scene::write(dir, spheres, 32);
+    check(paged_scene::is_written(dir, 501, 32), "paged scene: a written scene is recognized");
+    check(!paged_scene::is_written(dir, 500, 32), "paged scene: another sphere count is not taken for it");
+    check(!paged_scene::is_written(dir, 501, 16), "paged scene: another chunk size is not taken for it");
+
+    {
+        paged_scene world(dir, 1 << 12, palette); // a few chunks at a time, so they get evicted
+        check(world.size() == 501, "paged scene: sphere count survives the round trip");
+        check(same_hits(world, list), "paged scene: finds the same hits as the plain list");
+        check(world.chunks().evictions > 0, "paged scene: chunks were evicted under a small budget");
+    }
+
+    std::string index_path = dir + "/index.bin";
+    std::string chunk_path = chunk_cache::chunk_path(dir, 0);
+    std::string index = read_file(index_path);
+    std::string chunk = read_file(chunk_path);
+
+    auto index_rejected = [&](const std::string& bytes, const std::string& what) {
+        write_file(index_path, bytes);
+        check(throws([&]() { paged_scene world(dir, 1 << 20, palette); }), "paged scene: " + what + " is rejected");
+        write_file(index_path, index);
+    };
+    auto chunk_rejected = [&](const std::string& bytes, const std::string& what) {
+        write_file(chunk_path, bytes);
+        paged_scene world(dir, 1 << 20, palette);
+        check(throws([&]() {
+                  chunk_cache::read_guard guard(world.chunks());
+                  world.chunks().acquire(0, guard);
+              }), "paged scene: " + what + " is rejected");
+        write_file(chunk_path, chunk);
+    };
+
+    index_rejected(index.substr(0, index.size() - 1), "a truncated index");
+    index_rejected("", "an empty index");
+    std::string version = index;
+    std::uint32_t other = paged_scene::format_version + 1;
+    std::memcpy(&version[offsetof(paged_index_header, version)], &other, sizeof(other));
+    index_rejected(version, "an index of another format version");
+    std::string foreign = index;
+    foreign[0] = 'X';
+    index_rejected(foreign, "an index with the wrong magic");
+
+    chunk_rejected(chunk.substr(0, chunk.size() - 1), "a truncated chunk");
+    chunk_rejected("", "an empty chunk");
+    std::string bad_magic = chunk;
+    bad_magic[0] = 'X';
+    chunk_rejected(bad_magic, "a chunk with the wrong magic");
+
+    // Well formed on its own, but not the chunk the index describes
+    std::string shorter = chunk.substr(0, chunk.size() - sizeof(paged_sphere));
+    std::uint64_t fewer;
+    std::memcpy(&fewer, &shorter[offsetof(paged_chunk_header, count)], sizeof(fewer));
+    fewer--;
+    std::memcpy(&shorter[offsetof(paged_chunk_header, count)], &fewer, sizeof(fewer));
+    chunk_rejected(shorter, "a chunk with another sphere count than the index");
+
+    // A rewrite that fails half way must not leave the old index behind
+    std::string blocker = chunk_cache::chunk_path(dir, 3);
+    std::remove(blocker.c_str());
+    mkdir(blocker.c_str(), 0700);
+    check(throws([&]() { paged_scene::write(dir, spheres, 16); }), "paged scene: a failed write is reported");
+    check(!paged_scene::is_written(dir, 501, 32), "paged scene: a failed rewrite leaves no index behind");
+    rmdir(blocker.c_str());
+    paged_scene::write(dir, spheres, 32);
+
+    std::remove(index_path.c_str());
+    check(throws([&]() { paged_scene world(dir, 1 << 20, palette); }), "paged scene: a missing index is reported");
+    check(!paged_scene::is_written(dir, 501, 32), "paged scene: a directory without index is not taken as written");
+}
+
+int main() {
+    char bvh_dir[] = "/tmp/cache_check_bvh_XXXXXX";
+    char paged_dir[] = "/tmp/cache_check_paged_XXXXXX";
+    if (!mkdtemp(bvh_dir) || !mkdtemp(paged_dir)) {
+        std::cerr << "cannot create temporary directories\n";
+        return 1;
+    }
+
+    std::clog.setstate(std::ios::failbit); // the cache reports every rebuild, that is expected here
+    check_bvh_cache(bvh_dir);
+    check_paged_scene(paged_dir);
+    std::clog.clear();
+
+    std::system((std::string("rm -rf ") + bvh_dir + " " + paged_dir).c_str());
+
+    if (failures == 0) {
+        std::cout << "All cache checks passed\n";
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -2,6 +2,17 @@
 #define CAMERA_H
 
 #include "common.h"
+#include "environment.h"
+#include "path_guide.h"
+#include "render_pool.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
 
 /**
  * Construct and dispatch rays into the world.
@@ -12,6 +23,7 @@ class camera {
     public:
         double aspect_ratio;
         int image_width;
+        int requested_height = 0;    // Exact image height when > 0, aspect_ratio is then ignored
         int samples_per_pixel;
         int max_depth;
         double vertical_fov = 90;
@@ -22,52 +34,72 @@ class camera {
         double defocus_angle = 0.0;  // Variation angle of rays through each pixel
         double focus_dist = 10.0;    // Distance from camera lookfrom point to plane of perfect focus
 
-        camera() {}
+        int thread_count = 0;        // Render threads, 0 means one per hardware thread
+        shared_ptr<render_pool> pool; // Threads to render with, started on first use (with thread_count) and shared by copies
+        int tile_size = 16;          // Width and height of the square tiles handed to each thread
+        bool show_progress = true;   // Log progress to std::clog
 
-        void render(const hittable& world) {
-            initialize();
+        shared_ptr<path_guide> guide; // When set, render in passes that train the guide and sample from it
 
-            /* Image Output*/
-            std::cout << "P3\n" << image_width << " " << image_height << "\n255\n";
+        shared_ptr<const environment_light> environment; // Light for rays that miss everything, the sky gradient when unset
+        bool environment_sampling = true; // Also aim shadow rays at the bright parts of the environment
 
-            // Pixels are written out in rows, top to bottom
-            for (int j = 0; j < image_height; j++) {
-                std::clog << "\rScanlines remaining: " << image_height - j << " " << std::flush;
-                for (int i = 0; i < image_width; i++) {
-                    color pixel_color(0, 0, 0);
-                    for (int sample = 0; sample < samples_per_pixel; sample++) {
-                        ray r = get_ray(i, j);
-                        pixel_color += ray_color(r, world);
-                    }
+        camera() {}
 
-                    // Hello, pixel!
-                    // auto pixel_color = color(
-                    //     double(i) / (image_width - 1), // top right will be red
-                    //     double(j) / (image_height - 1),  // bottom left will be green
-                    //     0.25
-                    // );
+        void render(const hittable& world) {
+            render(world, std::cout);
+        }
 
-                    write_color(std::cout, pixel_samples_scale * pixel_color);
+        void render(const hittable& world, std::ostream& out) {
+            initialize();
+            auto start = std::chrono::steady_clock::now();
+
+            {
+                trace_span span("render", "camera");
+                span.arg("width", image_width);
+                span.arg("height", image_height);
+                span.arg("spp", samples_per_pixel);
+
+                if (guide) {
+                    render_guided(world);
+                } else {
+                    render_tiles(world, samples_per_pixel);
                 }
             }
-            std::clog << "\nDone.\n";
+
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            /* Image Output*/
+            write_image(out);
+            if (show_progress) {
+                // Variance times time is the cost of reaching a given noise level, so
+                // lower is better when comparing sampling strategies
+                double variance = mean_pixel_variance();
+                std::clog << "\nDone in " << seconds << " s, mean pixel variance " << variance
+                          << ", variance x time " << variance * seconds << "\n";
+            }
         }
 
-    private:
+        int height() const { return image_height; }
+
+    protected:
         vec3 center; // Camera center
         vec3 pixel00_loc; // Location of the first pixel 0,0
         vec3 pixel_delta_u; // Offset between pixels horizontally
         vec3 pixel_delta_v; // Offset between pixels vertically
         int image_height; // Rendered image height
-        double pixel_samples_scale; // Color scale factor for a sum of pixel samples
         vec3   u, v, w;              // Camera frame basis vectors
         vec3 defocus_disk_u; // Defocus disk horizontal radius
         vec3 defocus_disk_v; // Defocus disk vertical radius
+        std::vector<color> pixels;          // Sum of all samples per pixel, row by row from the top
+        std::vector<double> pixel_lum_sq;   // Sum of squared sample luminances, for the noise estimate
+        std::vector<int> pixel_counts;      // Number of samples summed in each pixel
+        std::vector<int> pixel_budget;      // Samples to add per pixel, overrides the spp passed to render_tiles when set
 
 
         void initialize() {
             /* Image Setup */
-            image_height = (int)(image_width / aspect_ratio);
+            image_height = requested_height > 0 ? requested_height : (int)(image_width / aspect_ratio);
             // Make sure image_height is greater than or equal to 1
             image_height = image_height < 1 ? 1 : image_height;
 
@@ -105,14 +137,15 @@ class camera {
             pixel_delta_u = viewport_u / image_width;
             pixel_delta_v = viewport_v / image_height;
 
-            std::clog << "Pixel u\n" << pixel_delta_u << "\n Pixel v " << pixel_delta_v << "\n";
+            if (show_progress) {
+                std::clog << "Pixel u\n" << pixel_delta_u << "\n Pixel v " << pixel_delta_v << "\n";
+            }
 
             auto viewport_upper_left = center
                 - focus_dist * w // cross the focal length to get to the viewport
                 - viewport_u/2 - viewport_v/2; // we're at the center of the viewport already, so move to the upper left
             pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v); // center of the first pixel
 
-            pixel_samples_scale = 1.0 / samples_per_pixel;
 
 
             // Calculate the camera defocus disk basis vectors.
@@ -120,9 +153,151 @@ class camera {
             defocus_disk_u = u * defocus_radius;
             defocus_disk_v = v * defocus_radius;
 
+            pixels.assign(image_width * image_height, color(0, 0, 0));
+            pixel_lum_sq.assign(image_width * image_height, 0.0);
+            pixel_counts.assign(image_width * image_height, 0);
+        }
+
+        void render_guided(const hittable& world) {
+            // Passes of 1, 2, 4, ... samples per pixel. After each pass the guide learns from
+            // everything recorded so far, so later (bigger) passes sample from a better guide.
+            // All passes are unbiased, so their samples are simply summed.
+            int done = 0;
+            for (int pass_spp = 1; done < samples_per_pixel; pass_spp *= 2) {
+                int spp = std::min(pass_spp, samples_per_pixel - done);
+                auto start = std::chrono::steady_clock::now();
+
+                trace_span span("guided pass", "camera");
+                span.arg("spp", spp);
+
+                render_tiles(world, spp);
+                {
+                    trace_span refresh_span("guide refresh", "camera");
+                    guide->refresh();
+                }
+                done += spp;
+
+                if (show_progress) {
+                    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    std::clog << "\nGuided pass: " << spp << " spp in " << seconds << " s, "
+                              << guide->leaf_count() << " guide leaves\n";
+                }
+            }
+        }
+
+        void render_tiles(const hittable& world, int spp) {
+            // Split the image into square tiles and let every thread grab the next free tile
+            // until there are none left. Tiles keep the work balanced: a thread that got cheap
+            // pixels (sky) just takes more tiles instead of sitting idle.
+            int tiles_x = (image_width + tile_size - 1) / tile_size;
+            int tiles_y = (image_height + tile_size - 1) / tile_size;
+            int tile_count = tiles_x * tiles_y;
+
+            if (!pool) {
+                pool = make_shared<render_pool>(thread_count);
+            }
+
+            std::atomic<int> next_tile(0);
+            std::atomic<int> tiles_done(0);
+            std::mutex log_mutex;
+
+            pool->run([&]() {
+                try {
+                    render_tiles_from(world, spp, next_tile, tiles_done, tiles_x, tile_count, log_mutex);
+                } catch (...) {
+                    next_tile = tile_count; // stop handing out tiles, the pool rethrows after the others finish
+                    throw;
+                }
+            });
+        }
+
+        // Worker loop: keep taking the next free tile until there are none left
+        void render_tiles_from(const hittable& world, int spp, std::atomic<int>& next_tile, std::atomic<int>& tiles_done,
+                               int tiles_x, int tile_count, std::mutex& log_mutex) {
+            for (int tile = next_tile++; tile < tile_count; tile = next_tile++) {
+                int x0 = (tile % tiles_x) * tile_size;
+                int y0 = (tile / tiles_x) * tile_size;
+                int x1 = std::min(x0 + tile_size, image_width);
+                int y1 = std::min(y0 + tile_size, image_height);
+
+                trace_span span("tile", "camera");
+                span.arg("x", x0);
+                span.arg("y", y0);
+
+                for (int j = y0; j < y1; j++) {
+                    for (int i = x0; i < x1; i++) {
+                        int index = j * image_width + i;
+                        int n = pixel_budget.empty() ? spp : pixel_budget[index];
+
+                        color pixel_color(0, 0, 0);
+                        double lum_sq = 0.0;
+                        for (int sample = 0; sample < n; sample++) {
+                            ray r = get_ray(i, j);
+                            color sample_color = ray_color(r, world);
+                            pixel_color += sample_color;
+                            lum_sq += luminance(sample_color) * luminance(sample_color);
+                        }
+                        pixels[index] += pixel_color;
+                        pixel_lum_sq[index] += lum_sq;
+                        pixel_counts[index] += n;
+                    }
+                }
+
+                int done = ++tiles_done;
+                if (show_progress) {
+                    std::lock_guard<std::mutex> lock(log_mutex);
+                    std::clog << "\rTiles remaining: " << tile_count - done << " " << std::flush;
+                }
+            }
+        }
+
+        void write_image(std::ostream& out) const {
+            if (!tracer::instance().enabled()) {
+                encode_ppm(out);
+                out.flush();
+                return;
+            }
+
+            // When tracing, encode into memory first so encoding and the actual I/O show up apart
+            std::ostringstream encoded;
+            {
+                trace_span span("encode ppm", "output");
+                encode_ppm(encoded);
+            }
+
+            trace_span span("write image", "output");
+            const std::string& bytes = encoded.str();
+            span.arg("bytes", (std::int64_t)bytes.size());
+            out.write(bytes.data(), bytes.size());
+            out.flush();
+        }
+
+        void encode_ppm(std::ostream& out) const {
+            out << "P3\n" << image_width << " " << image_height << "\n255\n";
+
+            // Pixels are written out in rows, top to bottom
+            for (std::size_t p = 0; p < pixels.size(); p++) {
+                double scale = pixel_counts[p] > 0 ? 1.0 / pixel_counts[p] : 0.0;
+                write_color(out, scale * pixels[p]);
+            }
         }
 
-        ray get_ray(int i, int j) {
+        // Average over all pixels of the estimated variance of the pixel's mean luminance
+        double mean_pixel_variance() const {
+            double total = 0.0;
+            for (std::size_t p = 0; p < pixels.size(); p++) {
+                double n = pixel_counts[p];
+                if (n < 2) {
+                    continue;
+                }
+                double mean = luminance(pixels[p]) / n;
+                double sample_variance = (pixel_lum_sq[p] - n * mean * mean) / (n - 1);
+                total += fmax(0.0, sample_variance) / n;
+            }
+            return total / pixels.size();
+        }
+
+        ray get_ray(int i, int j) const {
             // Construct a camera ray originating from the defocus disk and directed at a randomly
             // sampled point around the pixel location i, j.
             auto offset = sample_square();
@@ -146,7 +321,9 @@ class camera {
             return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
         }
 
-        color ray_color(const ray& r, const hittable& world, int depth = 0) {
+        color ray_color(const ray& r, const hittable& world, int depth = 0, double bounce_pdf = 0.0) const {
+            // bounce_pdf is the density with which the previous bounce picked r, or 0 when the
+            // environment was not sampled there (see background())
             if (depth >= max_depth) {
                 return color(0, 0, 0);
             }
@@ -155,11 +332,97 @@ class camera {
             if (world.hit(r, interval(0.001, infinity), rec)) { // 0.001 to avoid self-intersection
                 ray scattered;
                 color attenuation;
-                if (rec.mat->scatter(r, rec, attenuation, scattered)) {
+                if (!rec.mat->scatter(r, rec, attenuation, scattered)) {
+                    return color(0.0, 0.0, 0.0);
+                }
+
+                // Light reaching the last bounce could only be found by a shadow ray, which the
+                // plain path doesn't get either, so stop sampling one bounce early to match it
+                bool light_sampling = environment && environment_sampling && environment->can_sample()
+                                   && depth + 1 < max_depth;
+                double material_pdf = (guide || light_sampling) ? rec.mat->scattering_pdf(r, rec, scattered) : 0.0;
+                if (material_pdf <= 0) {
                     // Each ray loses 50% of its color when it bounces
                     return attenuation * ray_color(scattered, world, depth + 1);
                 }
-                return color(0.0, 0.0, 0.0);
+
+                // Guided bounce: pick the direction from the guide or from the material,
+                // and weigh it by the density of picking it with that mixture.
+                // A leaf can hold surfaces facing every way (think of a small sphere), so guide
+                // directions that point into the surface are mirrored to the outside instead of
+                // being wasted. The guide density then is that of d plus that of its mirror image.
+                int leaf = guide ? guide->find(rec.p) : 0;
+                double mix = guide && guide->usable(leaf) ? guide->mix : 0.0;
+                if (random_double() < mix) {
+                    vec3 d = guide->sample(leaf);
+                    if (dot(d, rec.normal) < 0) {
+                        d = reflect(d, rec.normal);
+                    }
+                    scattered = ray(rec.p, d);
+                    material_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+                }
+
+                color direct = light_sampling ? sample_environment(r, world, rec, attenuation, leaf, mix)
+                                              : color(0, 0, 0);
+                if (material_pdf <= 0) {
+                    return direct; // grazing the surface
+                }
+
+                double pdf = scatter_pdf(r, rec, scattered.direction(), leaf, mix);
+                color incoming = ray_color(scattered, world, depth + 1, light_sampling ? pdf : 0.0);
+                if (guide) {
+                    guide->record(leaf, scattered.direction(), luminance(incoming) * material_pdf / pdf);
+                }
+                return direct + attenuation * incoming * (material_pdf / pdf);
+            }
+
+            return background(r, bounce_pdf);
+        }
+
+        // Density of the bounce in ray_color picking direction: the material's own sampling,
+        // mixed with the guide (and the guide's mirror image) when mix > 0
+        double scatter_pdf(const ray& r, const hit_record& rec, const vec3& direction, int leaf, double mix) const {
+            double pdf = (1 - mix) * rec.mat->scattering_pdf(r, rec, ray(rec.p, direction));
+            if (mix > 0) {
+                vec3 d = unit_vector(direction);
+                pdf += mix * (guide->pdf(leaf, d) + guide->pdf(leaf, reflect(d, rec.normal)));
+            }
+            return pdf;
+        }
+
+        // Next event estimation: one shadow ray towards a direction picked from the environment
+        // by brightness. The bounce in ray_color can find the same light, so both are weighted
+        // with the power heuristic (multiple importance sampling): whichever of the two was
+        // more likely to pick a direction gets most of the credit for it.
+        color sample_environment(const ray& r, const hittable& world, const hit_record& rec,
+                                 const color& attenuation, int leaf, double mix) const {
+            vec3 d = environment->sample();
+            double material_pdf = rec.mat->scattering_pdf(r, rec, ray(rec.p, d));
+            double light_pdf = environment->pdf(d);
+            if (material_pdf <= 0 || light_pdf <= 0) {
+                return color(0, 0, 0); // behind the surface
+            }
+
+            hit_query shadow;
+            if (world.intersect(ray(rec.p, d), interval(0.001, infinity), shadow)) {
+                return color(0, 0, 0); // blocked, only the first hit matters so no surface record is built
+            }
+
+            double other_pdf = scatter_pdf(r, rec, d, leaf, mix);
+            double weight = light_pdf * light_pdf / (light_pdf * light_pdf + other_pdf * other_pdf);
+            return weight * attenuation * environment->lookup(d) * (material_pdf / light_pdf);
+        }
+
+        // Light from rays that hit nothing
+        color background(const ray& r, double bounce_pdf) const {
+            if (environment) {
+                color radiance = environment->lookup(r.direction());
+                if (bounce_pdf > 0) {
+                    // The previous bounce also sent a shadow ray, this is the other half of its MIS pair
+                    double light_pdf = environment->pdf(r.direction());
+                    radiance = radiance * (bounce_pdf * bounce_pdf / (bounce_pdf * bounce_pdf + light_pdf * light_pdf));
+                }
+                return radiance;
             }
 
             /* Simple Gradient */
@@ -35,6 +35,11 @@ inline double linear_to_gamma(double linear_component)
 
 using color = vec3;
 
+// Perceived brightness of a linear color (Rec. 709 weights)
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 void write_color(std::ostream &out, color pixel_color) {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
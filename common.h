@@ -5,6 +5,7 @@
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <random>
 #include <stdio.h>      /* printf, scanf, puts, NULL */
 #include <stdlib.h>
 #include <time.h>
@@ -28,8 +29,11 @@ inline double degrees_to_radians(double degrees) {
 }
 
 // Returns a number in the range [0, 1)
+// Every thread gets its own generator, std::rand() would make the render threads fight over one lock
 inline double random_double() {
-    return std::rand() / (RAND_MAX + 1.0);
+    static thread_local std::mt19937 generator(std::random_device{}());
+    static thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    return distribution(generator);
 }
 
 // Returns a number in the given range
@@ -43,6 +47,7 @@ inline double random_double(int min, int max) {
 #include "interval.h"
 #include "ray.h"
 #include "vec3.h"
+#include "aabb.h"
 #include "material.h"
 #include "hittable.h"
 #include "hittable_list.h"
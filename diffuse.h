@@ -22,6 +22,14 @@ class diffuse : public material {
             return true;
         }
 
+        // normal + random_unit_vector() is cosine distributed around the normal
+        virtual double scattering_pdf(
+            const ray& r_in, const hit_record& rec, const ray& scattered
+        ) const override {
+            auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
+            return cos_theta < 0 ? 0 : cos_theta / pi;
+        }
+
     private:
         color albedo;
 };
@@ -0,0 +1,195 @@
+/**
+ * @file environment.h
+ * @brief Light coming from infinitely far away, read from an HDR panorama.
+ *
+ * The image is an equirectangular (latitude/longitude) map: x runs around the
+ * horizon, y from straight up (top row) to straight down (bottom row).
+ *
+ * Bright spots like the sun are tiny but carry most of the light, so they are
+ * importance sampled: every pixel gets a probability proportional to its luminance
+ * times the solid angle it covers, and an alias table picks pixels by that
+ * probability in constant time. The light is immutable after loading, so all
+ * render threads share one copy.
+ */
+
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "common.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class environment_light {
+    public:
+        double intensity = 1.0; // Scale applied to every texel
+
+        // Load a PFM (portable float map) file, throws std::runtime_error if it can't be read
+        static shared_ptr<environment_light> load_pfm(const std::string& path) {
+            std::ifstream in(path, std::ios::binary);
+            std::string magic;
+            int width = 0, height = 0;
+            double scale = 0;
+            if (!(in >> magic >> width >> height >> scale) || (magic != "PF" && magic != "Pf")
+                || width <= 0 || height <= 0 || scale == 0) {
+                throw std::runtime_error("not a PFM file: " + path);
+            }
+            in.get(); // the single whitespace character before the raster
+
+            int channels = magic == "PF" ? 3 : 1;
+            std::vector<float> raw((std::size_t)width * height * channels);
+            if (!in.read(reinterpret_cast<char*>(raw.data()), raw.size() * sizeof(float))) {
+                throw std::runtime_error("truncated PFM file: " + path);
+            }
+
+            // A negative scale means little-endian data
+            std::uint16_t probe = 1;
+            bool host_little = *reinterpret_cast<unsigned char*>(&probe) == 1;
+            if ((scale < 0) != host_little) {
+                for (auto& value : raw) {
+                    unsigned char bytes[4];
+                    std::memcpy(bytes, &value, 4);
+                    std::swap(bytes[0], bytes[3]);
+                    std::swap(bytes[1], bytes[2]);
+                    std::memcpy(&value, bytes, 4);
+                }
+            }
+
+            // PFM rows go bottom to top, ours top to bottom
+            std::vector<float> rgb((std::size_t)width * height * 3);
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    std::size_t src = ((std::size_t)(height - 1 - y) * width + x) * channels;
+                    std::size_t dst = ((std::size_t)y * width + x) * 3;
+                    for (int c = 0; c < 3; c++) {
+                        float value = raw[src + (channels == 3 ? c : 0)];
+                        rgb[dst + c] = std::isfinite(value) && value > 0 ? value : 0.0f;
+                    }
+                }
+            }
+
+            return make_shared<environment_light>(width, height, std::move(rgb));
+        }
+
+        environment_light(int width, int height, std::vector<float> rgb)
+            : width(width), height(height), texels(std::move(rgb)) {
+            build_alias_table();
+        }
+
+        // Radiance arriving from direction dir
+        color lookup(const vec3& dir) const {
+            return intensity * texel(pixel_of(unit_vector(dir)));
+        }
+
+        // Whether sample() can be used (false for an all black map)
+        bool can_sample() const {
+            return total_weight > 0;
+        }
+
+        // Unit direction towards the map, chosen proportional to the light it brings
+        vec3 sample() const {
+            std::size_t count = alias.size();
+            std::size_t i = std::min((std::size_t)(random_double() * count), count - 1);
+            std::size_t pixel = random_double() < probability[i] ? i : alias[i];
+
+            double u = ((pixel % width) + random_double()) / width;
+            double v = ((pixel / width) + random_double()) / height;
+            double theta = v * pi;
+            double phi = 2 * pi * u - pi;
+            return vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+        }
+
+        // Solid angle density of sample() producing dir
+        double pdf(const vec3& dir) const {
+            if (!can_sample()) {
+                return 0;
+            }
+            vec3 d = unit_vector(dir);
+            double sin_theta = sqrt(fmax(0.0, 1 - d.y() * d.y()));
+            if (sin_theta <= 0) {
+                return 0;
+            }
+            std::size_t pixel = pixel_of(d);
+            double pmf = weight(pixel) / total_weight;
+            return pmf * width * height / (2 * pi * pi * sin_theta);
+        }
+
+    private:
+        int width;
+        int height;
+        std::vector<float> texels; // rgb, row by row from the top
+
+        // Vose's alias table: pick column i uniformly, keep it with probability[i],
+        // otherwise take alias[i]
+        std::vector<float> probability;
+        std::vector<std::uint32_t> alias;
+        double total_weight = 0;
+
+        color texel(std::size_t pixel) const {
+            return color(texels[3 * pixel], texels[3 * pixel + 1], texels[3 * pixel + 2]);
+        }
+
+        std::size_t pixel_of(const vec3& d) const {
+            double u = (atan2(d.z(), d.x()) + pi) / (2 * pi);
+            double v = acos(fmin(1.0, fmax(-1.0, d.y()))) / pi;
+            int x = std::min(std::max((int)(u * width), 0), width - 1);
+            int y = std::min(std::max((int)(v * height), 0), height - 1);
+            return (std::size_t)y * width + x;
+        }
+
+        // Sampling weight of a pixel: its luminance times the solid angle of its row.
+        // Recomputed on demand instead of stored, it is cheap and maps can be large.
+        double weight(std::size_t pixel) const {
+            double theta = ((pixel / width) + 0.5) / height * pi;
+            return luminance(texel(pixel)) * sin(theta);
+        }
+
+        void build_alias_table() {
+            std::size_t count = (std::size_t)width * height;
+            std::vector<double> scaled(count);
+            total_weight = 0;
+            for (std::size_t p = 0; p < count; p++) {
+                scaled[p] = weight(p);
+                total_weight += scaled[p];
+            }
+
+            probability.assign(count, 1.0f);
+            alias.resize(count);
+            for (std::size_t p = 0; p < count; p++) {
+                alias[p] = (std::uint32_t)p;
+            }
+            if (total_weight <= 0) {
+                return;
+            }
+
+            // Scale so the average is 1, then pair every under-full column with an over-full one
+            std::vector<std::uint32_t> small, large;
+            for (std::size_t p = 0; p < count; p++) {
+                scaled[p] *= count / total_weight;
+                (scaled[p] < 1.0 ? small : large).push_back((std::uint32_t)p);
+            }
+
+            while (!small.empty() && !large.empty()) {
+                std::uint32_t s = small.back();
+                small.pop_back();
+                std::uint32_t l = large.back();
+
+                probability[s] = (float)scaled[s];
+                alias[s] = l;
+                scaled[l] -= 1.0 - scaled[s];
+                if (scaled[l] < 1.0) {
+                    large.pop_back();
+                    small.push_back(l);
+                }
+            }
+            // Whatever is left is 1 up to rounding
+            for (auto p : small) probability[p] = 1.0f;
+            for (auto p : large) probability[p] = 1.0f;
+        }
+};
+
+#endif
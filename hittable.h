@@ -3,13 +3,29 @@
 
 #include "common.h"
 
+class hittable;
+
+/**
+ * Result of the traversal phase of a hit test.
+ * Only holds what is needed to find the closest hit: the ray parameter t and
+ * which primitive produced it. The full surface interaction is built later,
+ * once, for the winner (see hittable::interact).
+ */
+class hit_query {
+    public:
+        double t;
+        const hittable* object = nullptr; // primitive that produced the hit
+        std::size_t prim = 0;             // primitive id inside object, for objects holding many primitives
+        vec3 local;                       // primitive-local data (e.g. barycentrics), unused by spheres
+};
+
 class hit_record {
     public:
         vec3 p;
         vec3 normal;
         double t;
         bool front_face;
-        shared_ptr<material> mat;
+        const material* mat; // not owning, the primitive keeps the material alive
 
 };
 
@@ -17,7 +33,27 @@ class hittable {
     public:
         virtual ~hittable() {}
 
-        virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+        // Phase 1: find the closest hit in ray_t. Only records t and the primitive in q,
+        // no points, normals or materials are computed here.
+        virtual bool intersect(const ray& r, interval ray_t, hit_query& q) const = 0;
+
+        // Phase 2: build the full surface interaction for a hit found by intersect().
+        // Called once per ray, on the primitive stored in q.object.
+        virtual void interact(const ray& r, const hit_query& q, hit_record& rec) const = 0;
+
+        // Box enclosing the whole object, used to build acceleration structures
+        virtual aabb bounding_box() const = 0;
+
+        // Run both phases
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const {
+            hit_query q;
+            if (!intersect(r, ray_t, q)) {
+                return false;
+            }
+
+            q.object->interact(r, q, rec);
+            return true;
+        }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -20,25 +20,40 @@ class hittable_list : public hittable {
         hittable_list() {}
         hittable_list(std::shared_ptr<hittable> object) { add(object); }
 
-        void clear() { objects.clear(); }
+        void clear() {
+            objects.clear();
+            bbox = aabb();
+        }
 
-        void add(std::shared_ptr<hittable> object) { objects.push_back(object); }
+        void add(std::shared_ptr<hittable> object) {
+            objects.push_back(object);
+            bbox = aabb(bbox, object->bounding_box());
+        }
 
-        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            hit_record temp_rec;
+        bool intersect(const ray& r, interval ray_t, hit_query& q) const override {
             bool hit_anything = false;
-            auto closest_so_far = ray_t.max;
 
+            // Each object shrinks ray_t.max, so q always ends up holding the closest hit.
+            // Nothing but t and the primitive is copied around while searching.
             for (const auto& object : objects) {
-                if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+                if (object->intersect(r, ray_t, q)) {
                     hit_anything = true;
-                    closest_so_far = temp_rec.t; // update the closest hit
-                    rec = temp_rec; // copy the hit record
+                    ray_t.max = q.t; // update the closest hit
                 }
             }
 
             return hit_anything;
         }
+
+        void interact(const ray& r, const hit_query& q, hit_record& rec) const override {
+            // intersect() never reports the list itself, q.object is always a primitive
+            q.object->interact(r, q, rec);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+    private:
+        aabb bbox;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+/**
+ * @file json.h
+ * @brief Just enough JSON to read render jobs: numbers, strings, booleans,
+ * null, arrays and objects. No unicode escapes beyond passing them through.
+ */
+
+#ifndef JSON_H
+#define JSON_H
+
+#include <cctype>
+#include <cstdlib>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class json_value {
+    public:
+        enum kind { null, boolean, number, string, array, object };
+
+        kind type = null;
+        bool b = false;
+        double num = 0.0;
+        std::string str;
+        std::vector<json_value> items;               // array elements
+        std::map<std::string, json_value> members;   // object members
+
+        bool has(const std::string& key) const {
+            return type == object && members.count(key) > 0;
+        }
+
+        const json_value& operator[](const std::string& key) const {
+            return members.at(key);
+        }
+
+        // Deepest nesting of arrays and objects accepted, parsing recurses once per level
+        static const int max_depth = 32;
+
+        // Parse a complete document, throws std::runtime_error on malformed input
+        static json_value parse(const std::string& text) {
+            std::size_t pos = 0;
+            json_value value = parse_value(text, pos, 0);
+            skip_space(text, pos);
+            if (pos != text.size()) {
+                throw std::runtime_error("json: trailing characters");
+            }
+            return value;
+        }
+
+    private:
+        static void skip_space(const std::string& text, std::size_t& pos) {
+            while (pos < text.size() && std::isspace((unsigned char)text[pos])) {
+                pos++;
+            }
+        }
+
+        static void expect(const std::string& text, std::size_t& pos, char c) {
+            skip_space(text, pos);
+            if (pos >= text.size() || text[pos] != c) {
+                throw std::runtime_error(std::string("json: expected '") + c + "'");
+            }
+            pos++;
+        }
+
+        static std::string parse_string(const std::string& text, std::size_t& pos) {
+            expect(text, pos, '"');
+            std::string out;
+            while (pos < text.size() && text[pos] != '"') {
+                char c = text[pos++];
+                if (c == '\\' && pos < text.size()) {
+                    char e = text[pos++];
+                    switch (e) {
+                        case 'n': out += '\n'; break;
+                        case 't': out += '\t'; break;
+                        case 'r': out += '\r'; break;
+                        case 'b': out += '\b'; break;
+                        case 'f': out += '\f'; break;
+                        default:  out += e;    break; // \" \\ \/ (and \u is kept as-is)
+                    }
+                } else {
+                    out += c;
+                }
+            }
+            expect(text, pos, '"');
+            return out;
+        }
+
+        static json_value parse_value(const std::string& text, std::size_t& pos, int depth) {
+            skip_space(text, pos);
+            if (pos >= text.size()) {
+                throw std::runtime_error("json: unexpected end of input");
+            }
+
+            json_value value;
+            char c = text[pos];
+
+            if ((c == '{' || c == '[') && depth >= max_depth) {
+                throw std::runtime_error("json: nested too deeply");
+            }
+
+            if (c == '{') {
+                value.type = object;
+                pos++;
+                skip_space(text, pos);
+                if (pos < text.size() && text[pos] == '}') {
+                    pos++;
+                    return value;
+                }
+                while (true) {
+                    std::string key = parse_string(text, pos);
+                    expect(text, pos, ':');
+                    value.members[key] = parse_value(text, pos, depth + 1);
+                    skip_space(text, pos);
+                    if (pos < text.size() && text[pos] == ',') {
+                        pos++;
+                        continue;
+                    }
+                    expect(text, pos, '}');
+                    return value;
+                }
+            }
+
+            if (c == '[') {
+                value.type = array;
+                pos++;
+                skip_space(text, pos);
+                if (pos < text.size() && text[pos] == ']') {
+                    pos++;
+                    return value;
+                }
+                while (true) {
+                    value.items.push_back(parse_value(text, pos, depth + 1));
+                    skip_space(text, pos);
+                    if (pos < text.size() && text[pos] == ',') {
+                        pos++;
+                        continue;
+                    }
+                    expect(text, pos, ']');
+                    return value;
+                }
+            }
+
+            if (c == '"') {
+                value.type = string;
+                value.str = parse_string(text, pos);
+                return value;
+            }
+
+            if (text.compare(pos, 4, "true") == 0) {
+                value.type = boolean;
+                value.b = true;
+                pos += 4;
+                return value;
+            }
+            if (text.compare(pos, 5, "false") == 0) {
+                value.type = boolean;
+                pos += 5;
+                return value;
+            }
+            if (text.compare(pos, 4, "null") == 0) {
+                pos += 4;
+                return value;
+            }
+
+            // Anything else has to be a number
+            const char* start = text.c_str() + pos;
+            char* end = nullptr;
+            value.num = std::strtod(start, &end);
+            if (end == start) {
+                throw std::runtime_error("json: unexpected character");
+            }
+            value.type = number;
+            pos += end - start;
+            return value;
+        }
+};
+
+#endif
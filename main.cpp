@@ -1,8 +1,131 @@
 #include "common.h"
+#include "animation.h"
+#include "autotune.h"
 #include "camera.h"
-#include "diffuse.h"
-#include "metal.h"
-#include "dielectric.h"
+#include "scenes.h"
+#include "bvh.h"
+#include "bvh_cache.h"
+#include "environment.h"
+#include "paged_geometry.h"
+#include "path_guide.h"
+#include "render_server.h"
+#include "trace.h"
+
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Write a large sphere field as chunk files (unless dir already has one), then render it
+// with the chunk cache limited to budget_mb and report how the paging behaved.
+// Run it twice to measure the process without the generation step in its peak RSS.
+int run_paged_bench(const std::string& dir, std::size_t sphere_count, std::size_t budget_mb, std::size_t chunk_size) {
+    // sphere_field adds a ground sphere to the requested count
+    bool needs_generation = !paged_scene::is_written(dir, sphere_count + 1, chunk_size);
+
+    std::vector<shared_ptr<material>> palette;
+    auto spheres = sphere_field(needs_generation ? sphere_count : 0, palette);
+    if (needs_generation) {
+        paged_scene::write(dir, spheres, chunk_size);
+    }
+    std::vector<paged_sphere>().swap(spheres); // the generated records are gone before rendering starts
+
+    paged_scene world(dir, budget_mb << 20, palette);
+
+    camera cam = default_camera();
+    cam.lookfrom = vec3(13, 2, 3);
+    cam.lookat = vec3(0, 0, 0);
+    cam.defocus_angle = 0.6;
+    cam.focus_dist = 10.0;
+
+    auto start = std::chrono::steady_clock::now();
+    cam.render(world);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    auto& chunks = world.chunks();
+    double scene_mb = double(world.size() * sizeof(paged_sphere)) / (1 << 20);
+    std::clog << "Paged bench: " << world.size() << " spheres, " << scene_mb << " MB of geometry, "
+              << budget_mb << " MB chunk budget\n"
+              << "  render time:     " << seconds << " s\n"
+              << "  chunk hits:      " << chunks.hits() << "\n"
+              << "  chunk page-ins:  " << chunks.page_ins << "\n"
+              << "  evictions:       " << chunks.evictions << "\n"
+              << "  peak mapped:     " << double(chunks.peak_resident_bytes) / (1 << 20) << " MB\n"
+              << "  peak process RSS " << usage.ru_maxrss / 1024.0 << " MB\n";
+    return 0;
+}
+
+// A --frames-out pattern is handed to snprintf, so it may hold exactly one integer
+// conversion (%d, optionally with zero padding and a width, like %04d) and %% escapes
+bool valid_frame_pattern(const std::string& pattern) {
+    int conversions = 0;
+    for (std::size_t i = 0; i < pattern.size(); i++) {
+        if (pattern[i] != '%') {
+            continue;
+        }
+        i++;
+        if (i < pattern.size() && pattern[i] == '%') {
+            continue;
+        }
+        while (i < pattern.size() && std::isdigit((unsigned char)pattern[i])) {
+            i++;
+        }
+        if (i >= pattern.size() || pattern[i] != 'd') {
+            return false;
+        }
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+// Parse all of text as a number between lo and hi, whole numbers only if whole is set.
+// std::stoi and friends throw on "abc" and quietly take the 10 of "10x", so options use this instead.
+bool parse_number(const char* text, double lo, double hi, bool whole, double& value) {
+    char* end = nullptr;
+    errno = 0;
+    value = std::strtod(text, &end);
+    return end != text && *end == '\0' && errno == 0 && std::isfinite(value)
+        && value >= lo && value <= hi && (!whole || value == std::floor(value));
+}
+
+// Orbit the camera around its lookat point, degrees_per_frame about the vup axis, and
+// write every frame to a file named by printf-style pattern (e.g. frame_%04d.ppm)
+int run_animation(const hittable& world, const camera& base, int frames, double degrees_per_frame,
+                  const std::string& pattern) {
+    animated_camera cam;
+    static_cast<camera&>(cam) = base;
+    cam.defocus_angle = 0; // history is reprojected through pixel centers, see animation.h
+
+    vec3 axis = unit_vector(base.vup);
+    vec3 offset = base.lookfrom - base.lookat;
+
+    for (int frame = 0; frame < frames; frame++) {
+        // Rodrigues' rotation of offset about axis
+        double angle = degrees_to_radians(degrees_per_frame * frame);
+        vec3 rotated = offset * cos(angle) + cross_product(axis, offset) * sin(angle)
+                     + axis * dot(axis, offset) * (1 - cos(angle));
+
+        char path[1024];
+        std::snprintf(path, sizeof(path), pattern.c_str(), frame);
+        std::ofstream out(path);
+        if (!out) {
+            std::cerr << "Cannot write " << path << "\n";
+            return 1;
+        }
+
+        cam.render_frame(world, camera_pose{ base.lookat + rotated, base.lookat, base.vup }, out);
+    }
+    return 0;
+}
 
 /**
  * What does a Raytracer do?
@@ -10,37 +133,230 @@
  * 2. Determine what the ray hits
  * 3. Determine the color of the hit
  * 4. Write the color to the image
+ *
+ * Usage:
+ *   raytracer [options] > image.ppm     render the default scene once
+ *   raytracer --server [options]        keep scenes resident and read JSON render jobs from stdin
+ *   raytracer --animate <frames> [options]
+ *                                       orbit the camera, reusing samples between frames
+ *   raytracer --paged-bench <dir> > image.ppm
+ *                                       render a sphere field paged in from chunk files in dir
+ *
+ * --server, --animate and --paged-bench exclude each other.
+ *
+ * Options:
+ *   --bvh-cache <dir>    reuse BVHs stored in dir, or store them there after building
+ *   --guiding            learn where light comes from while rendering and aim bounces there
+ *                        (single renders only, not with --server, --animate or --paged-bench)
+ *   --trace <file>       record what every thread did and write it as Chrome trace JSON
+ *   --env <file.pfm>     light the scene with an equirectangular HDR image instead of the sky gradient
+ *                        (not with --paged-bench)
+ *   --env-intensity <x>  multiply the environment's radiance by x (default 1)
+ *   --env-naive          only look the environment up when rays miss, without shadow rays towards it
+ *                        (to compare noise, see "variance x time" in the log)
+ *   --autotune           time test renders to find the fastest tile size, thread count and
+ *                        BVH leaf size, and remember them for this machine and scene
+ *   --autotune-file <f>  where tuned settings are kept (default ~/.raytracer_autotune).
+ *                        Settings found there are used automatically.
+ *   --frames-out <pat>   file name pattern for --animate, with one %d for the frame number
+ *                        (default frame_%04d.ppm)
+ *   --orbit <degrees>    camera rotation per frame for --animate (default 1)
+ *   --paged-spheres <n>  spheres in the paged bench scene (default 1000000)
+ *   --paged-budget <mb>  megabytes of chunks kept mapped at once (default 4)
+ *   --paged-chunk <n>    spheres per chunk file (default 256)
  */
-int main() {
-    srand(time(NULL));
-
-    /* World Setup */
-    hittable_list world;
-    auto material_ground = make_shared<diffuse>(color(0.8, 0.8, 0.0));
-    auto material_center = make_shared<diffuse>(color(0.1, 0.2, 0.5));
-    auto material_left   = make_shared<dielectric>(1.5); // Air to Glass
-    auto material_bubble = make_shared<dielectric>(1.00 / 1.5); // Glass to Air
-    auto material_right  = make_shared<metal>(color(0.8, 0.6, 0.2), 1.0);
-
-    world.add(make_shared<sphere>(vec3( 0.0, -100.5, -1.0), 100.0, material_ground));
-    world.add(make_shared<sphere>(vec3( 0.0,    0.0, -1.2),   0.5, material_center));
-    world.add(make_shared<sphere>(vec3(-1.0,    0.0, -1.0),   0.5, material_left));
-    world.add(make_shared<sphere>(vec3(-1.0,    0.0, -1.0),   0.4, material_bubble));
-    world.add(make_shared<sphere>(vec3( 1.0,    0.0, -1.0),   0.5, material_right));
+int main(int argc, char* argv[]) {
+    bool server_mode = false;
+    bool guiding = false;
+    bool autotune = false;
+    bool env_naive = false;
+    std::string env_path;
+    double env_intensity = 1.0;
+    std::string bvh_cache_dir;
+    std::string trace_path;
+    std::string autotune_path = std::string(getenv("HOME") ? getenv("HOME") : ".") + "/.raytracer_autotune";
+    std::string paged_dir;
+    int animate_frames = 0;
+    double orbit_degrees = 1.0;
+    std::string frames_pattern = "frame_%04d.ppm";
+    std::size_t paged_spheres = 1000000;
+    std::size_t paged_budget_mb = 4;
+    std::size_t paged_chunk = 256;
+
+    // Parse argv[i] as the value of option, or say what was expected
+    double number = 0;
+    auto number_arg = [&](int i, const char* option, double lo, double hi, bool whole) {
+        if (parse_number(argv[i], lo, hi, whole, number)) {
+            return true;
+        }
+        std::cerr << option << " needs " << (whole ? "a whole number" : "a number") << " from "
+                  << (long long)lo << " to " << (long long)hi << ", got " << argv[i] << "\n";
+        return false;
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--server") == 0) {
+            server_mode = true;
+        } else if (std::strcmp(argv[i], "--guiding") == 0) {
+            guiding = true;
+        } else if (std::strcmp(argv[i], "--bvh-cache") == 0 && i + 1 < argc) {
+            bvh_cache_dir = argv[++i];
+        } else if (std::strcmp(argv[i], "--autotune") == 0) {
+            autotune = true;
+        } else if (std::strcmp(argv[i], "--autotune-file") == 0 && i + 1 < argc) {
+            autotune_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--env") == 0 && i + 1 < argc) {
+            env_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--env-intensity") == 0 && i + 1 < argc) {
+            if (!number_arg(++i, "--env-intensity", 0, 1000000, false)) {
+                return 1;
+            }
+            env_intensity = number;
+        } else if (std::strcmp(argv[i], "--env-naive") == 0) {
+            env_naive = true;
+        } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--animate") == 0 && i + 1 < argc) {
+            if (!number_arg(++i, "--animate", 1, 1000000, true)) {
+                return 1;
+            }
+            animate_frames = (int)number;
+        } else if (std::strcmp(argv[i], "--frames-out") == 0 && i + 1 < argc) {
+            frames_pattern = argv[++i];
+        } else if (std::strcmp(argv[i], "--orbit") == 0 && i + 1 < argc) {
+            if (!number_arg(++i, "--orbit", -360, 360, false)) {
+                return 1;
+            }
+            orbit_degrees = number;
+        } else if (std::strcmp(argv[i], "--paged-bench") == 0 && i + 1 < argc) {
+            paged_dir = argv[++i];
+        } else if (std::strcmp(argv[i], "--paged-spheres") == 0 && i + 1 < argc) {
+            if (!number_arg(++i, "--paged-spheres", 1, 1e9, true)) {
+                return 1;
+            }
+            paged_spheres = (std::size_t)number;
+        } else if (std::strcmp(argv[i], "--paged-budget") == 0 && i + 1 < argc) {
+            if (!number_arg(++i, "--paged-budget", 1, 1 << 20, true)) {
+                return 1;
+            }
+            paged_budget_mb = (std::size_t)number;
+        } else if (std::strcmp(argv[i], "--paged-chunk") == 0 && i + 1 < argc) {
+            if (!number_arg(++i, "--paged-chunk", 1, 1 << 24, true)) {
+                return 1;
+            }
+            paged_chunk = (std::size_t)number;
+        } else {
+            std::cerr << "Unknown option " << argv[i] << "\n";
+            return 1;
+        }
+    }
+
+    bool paged_bench = !paged_dir.empty();
+    if ((int)server_mode + (int)(animate_frames > 0) + (int)paged_bench > 1) {
+        std::cerr << "--server, --animate and --paged-bench can't be combined\n";
+        return 1;
+    }
+    if (guiding && (server_mode || animate_frames > 0 || paged_bench)) {
+        std::cerr << "--guiding only works for single renders, not with --server, --animate or --paged-bench\n";
+        return 1;
+    }
+    if (env_intensity != 1.0 && env_path.empty()) {
+        std::cerr << "--env-intensity needs an --env map to scale\n";
+        return 1;
+    }
+    if (!env_path.empty() && paged_bench) {
+        std::cerr << "--env doesn't apply to --paged-bench, it renders its own scene and sky\n";
+        return 1;
+    }
+    if (animate_frames > 0 && !valid_frame_pattern(frames_pattern)) {
+        std::cerr << "--frames-out needs exactly one %d (e.g. frame_%04d.ppm), got " << frames_pattern << "\n";
+        return 1;
+    }
+
+    if (!trace_path.empty()) {
+        tracer::instance().start();
+        tracer::instance().name_thread("main");
+    }
 
     /* Camera */
-    camera cam;
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 400;
-    cam.max_depth = 10;
-    cam.samples_per_pixel = 10;
-    cam.vertical_fov = 20.0;
-    cam.lookfrom = vec3(-2,2,1);
-    cam.lookat = vec3(0,0,-1);
-    cam.vup = vec3(0,1,0);
-
-    cam.defocus_angle = 10.0;
-    cam.focus_dist = 3.4;
+    camera base_cam = default_camera();
+    if (!env_path.empty()) {
+        // Loaded once, every camera copy and render thread shares it
+        try {
+            trace_span span("environment load", "scene");
+            auto environment = environment_light::load_pfm(env_path);
+            environment->intensity = env_intensity; // the last change before it is shared read-only
+            base_cam.environment = environment;
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        base_cam.environment_sampling = !env_naive;
+    }
 
-    cam.render(world);
-}
\ No newline at end of file
+    // Tuned settings for this machine and scene: measured now, or remembered from an earlier run
+    render_config config;
+    if (paged_dir.empty()) {
+        autotuner tuner(autotune_path);
+        hittable_list list = default_scene();
+        if (guiding) {
+            // Set before tuning, guiding changes the cost of every sample
+            base_cam.guide = make_shared<path_guide>(list.bounding_box());
+        }
+        std::string scene_id = autotuner::scene_fingerprint(list, base_cam);
+
+        if (autotune) {
+            config = tuner.tune(list, base_cam);
+            if (!tuner.store(scene_id, config)) {
+                std::cerr << "Could not save tuned settings to " << autotune_path << "\n";
+            }
+        }
+        if (autotune || tuner.lookup(scene_id, config)) {
+            std::clog << "Tuned settings: tile " << config.tile_size << ", threads " << config.thread_count
+                      << ", leaf " << config.leaf_size << "\n";
+        }
+        autotuner::apply(config, base_cam);
+    }
+
+    // Build the default scene and wrap its objects in a BVH, from the cache when one is configured
+    auto build_world = [&]() -> shared_ptr<hittable> {
+        trace_span span("scene build", "scene");
+        hittable_list list = default_scene();
+        if (bvh_cache_dir.empty()) {
+            return make_shared<bvh>(list, config.leaf_size);
+        }
+        return bvh_cache(bvh_cache_dir).load_or_build(list, config.leaf_size);
+    };
+
+    int status = 0;
+
+    if (!paged_dir.empty()) {
+        // Missing or damaged chunk files show up as exceptions, from writing or mid-render
+        try {
+            status = run_paged_bench(paged_dir, paged_spheres, paged_budget_mb, paged_chunk);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            status = 1;
+        }
+    } else if (server_mode) {
+        render_server server;
+        server.thread_count = config.thread_count;
+        server.add_scene("default", build_world, base_cam);
+        server.run(std::cin, std::cout);
+    } else if (animate_frames > 0) {
+        auto world = build_world();
+        status = run_animation(*world, base_cam, animate_frames, orbit_degrees, frames_pattern);
+    } else {
+        /* World Setup */
+        auto world = build_world();
+
+        camera cam = base_cam;
+        cam.render(*world);
+    }
+
+    if (!trace_path.empty() && !tracer::instance().write(trace_path)) {
+        std::cerr << "Could not write trace to " << trace_path << "\n";
+        status = 1;
+    }
+    return status;
+}
@@ -14,6 +14,13 @@ class material {
         ) const {
             return false;
         }
+
+        // Solid angle density with which scatter() would pick scattered's direction.
+        // 0 means the material can't say (mirror-like or refracting), so the direction
+        // it picked must be used as-is and can't be mixed with other sampling strategies.
+        virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+            return 0;
+        }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,581 @@
+/**
+ * @file paged_geometry.h
+ * @brief Out-of-core spheres for scenes that don't fit in memory.
+ *
+ * The spheres are stored as plain records in chunk files on disk, each chunk holding
+ * spheres that are close to each other. Only a small index stays resident: the bounding
+ * box of every chunk and a BVH over those boxes. When a ray reaches a chunk's box the
+ * chunk is mapped in through a bounded cache, and chunks that haven't been used lately
+ * are unmapped once the cache goes over its byte budget.
+ *
+ * Spheres much bigger than the rest (a ground sphere) would give their chunk a box around
+ * the whole scene, so every ray would page that chunk in. They are kept in the index
+ * instead and stay resident.
+ *
+ * Directory layout (host byte order):
+ *   index.bin          paged_index_header | paged_chunk_info[chunk_count] | paged_sphere[resident_count]
+ *   chunk_000000.bin   paged_chunk_header | paged_sphere[count]
+ *
+ * index.bin is written last, so a directory with an index always has all its chunks.
+ */
+
+#ifndef PAGED_GEOMETRY_H
+#define PAGED_GEOMETRY_H
+
+#include "common.h"
+#include "bvh.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A sphere as plain data, the material is an index into the scene's resident palette
+struct paged_sphere {
+    double center[3];
+    double radius;
+    std::uint32_t material;
+    std::uint32_t pad;
+};
+
+struct paged_index_header {
+    char magic[8];           // "RTPAGE\0\0"
+    std::uint32_t version;
+    std::uint32_t chunk_count;
+    std::uint64_t sphere_count;   // all spheres, resident ones included
+    std::uint32_t chunk_size;     // most spheres per chunk the scene was written with
+    std::uint32_t resident_count; // spheres stored in the index itself
+};
+
+struct paged_chunk_info {
+    double bounds_min[3];
+    double bounds_max[3];
+    std::uint32_t count;
+    std::uint32_t pad;
+};
+
+struct paged_chunk_header {
+    char magic[8];           // "RTCHUNK\0"
+    std::uint64_t count;
+};
+
+/**
+ * Bounded cache of mapped chunk files.
+ *
+ * Every ray touches several chunk boxes, so using a resident chunk must not take a lock
+ * or write to memory other threads use. Readers get plain pointers, valid while they
+ * hold a read_guard, and count their hits in their own record. Eviction doesn't unmap
+ * right away: the chunk is retired with the current epoch and unmapped once every thread
+ * that might still hold a pointer to it has left its guard (epoch based reclamation).
+ *
+ * Recency is tracked with the clock algorithm: a use only sets the chunk's referenced
+ * bit, and eviction (under the lock, only when paging in) skips chunks whose bit is set,
+ * clearing it as it passes, so recently used chunks get a second chance.
+ */
+class chunk_cache {
+    private:
+        // One per thread that ever read from this cache, padded so threads don't share lines
+        struct alignas(64) reader {
+            std::atomic<std::uint64_t> epoch{0}; // epoch the thread entered its guard in, 0 when outside
+            std::atomic<std::uint64_t> hits{0};  // only written by the owning thread
+            int depth = 0;                       // nested guards
+        };
+
+    public:
+        struct chunk {
+            void* data = MAP_FAILED;
+            std::size_t size = 0;
+            std::uint64_t count = 0;
+            const paged_sphere* spheres = nullptr;
+
+            ~chunk() {
+                if (data != MAP_FAILED) {
+                    munmap(data, size);
+                }
+            }
+        };
+
+        // While one is alive, pointers returned by acquire() on this thread stay valid.
+        // Guards nest, only the outermost one publishes the epoch.
+        class read_guard {
+            public:
+                explicit read_guard(chunk_cache& cache) : self(cache.local_reader()) {
+                    if (self->depth++ == 0) {
+                        self->epoch.store(cache.epoch.load());
+                    }
+                }
+
+                ~read_guard() {
+                    if (--self->depth == 0) {
+                        self->epoch.store(0, std::memory_order_release);
+                    }
+                }
+
+                read_guard(const read_guard&) = delete;
+                read_guard& operator=(const read_guard&) = delete;
+
+            private:
+                friend class chunk_cache;
+                reader* self;
+        };
+
+        // Counters for benchmarking, safe to read while rendering
+        std::atomic<std::uint64_t> page_ins{0};
+        std::atomic<std::uint64_t> evictions{0};
+        std::atomic<std::size_t> peak_resident_bytes{0};
+
+        chunk_cache(const std::string& directory, std::size_t budget_bytes)
+            : directory(directory), budget_bytes(budget_bytes), id(next_id()) {}
+
+        chunk_cache(const chunk_cache&) = delete;
+        chunk_cache& operator=(const chunk_cache&) = delete;
+
+        // Must be called once, before the first acquire(), with the sphere count of every chunk
+        void set_chunks(std::vector<std::uint32_t> counts) {
+            slots.reset(new slot[counts.size()]);
+            expected_counts = std::move(counts);
+        }
+
+        // Uses of resident chunks, summed over all threads
+        std::uint64_t hits() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::uint64_t total = 0;
+            for (const auto& r : readers) {
+                total += r->hits.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+        // Chunk id, mapped in if needed. Valid until guard ends.
+        const chunk* acquire(std::uint32_t id, read_guard& guard) {
+            slot& s = slots[id];
+            const chunk* data = s.data.load();
+            if (data) {
+                // Only write when needed, so threads sharing a hot chunk don't fight over the line
+                if (!s.referenced.load(std::memory_order_relaxed)) {
+                    s.referenced.store(true, std::memory_order_relaxed);
+                }
+                guard.self->hits.store(guard.self->hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return data;
+            }
+
+            // Map outside the lock so other threads keep working on resident chunks.
+            // Two threads may race to map the same chunk, the loser's copy is just dropped.
+            std::unique_ptr<const chunk> loaded = map_chunk(id);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            data = s.data.load();
+            if (data) {
+                return data;
+            }
+
+            page_ins++;
+            data = loaded.get();
+            resident_bytes += data->size;
+            s.owner = std::move(loaded);
+            s.data.store(data);
+            s.referenced = true;
+            resident.push_back(id);
+
+            // Always keep the chunk we just mapped, even if it alone is over budget. After two
+            // full turns every bit has been cleared once, so evict regardless from then on.
+            for (std::size_t steps = 0; resident_bytes > budget_bytes && resident.size() > 1; steps++) {
+                hand %= resident.size();
+                std::uint32_t victim = resident[hand];
+                slot& v = slots[victim];
+                if (victim == id || (steps < 2 * resident.size() && v.referenced.exchange(false))) {
+                    hand++;
+                    continue;
+                }
+
+                // Readers that enter after the epoch moves on can't see the pointer anymore
+                v.data.store(nullptr);
+                resident_bytes -= v.owner->size;
+                retired.push_back(retired_chunk{ std::move(v.owner), epoch.fetch_add(1) });
+                resident[hand] = resident.back();
+                resident.pop_back();
+                evictions++;
+            }
+            reclaim();
+
+            if (resident_bytes > peak_resident_bytes) {
+                peak_resident_bytes = resident_bytes;
+            }
+            return data;
+        }
+
+        static std::string chunk_path(const std::string& directory, std::uint32_t id) {
+            char name[32];
+            std::snprintf(name, sizeof(name), "/chunk_%06u.bin", id);
+            return directory + name;
+        }
+
+    private:
+        struct slot {
+            std::atomic<const chunk*> data{nullptr}; // what readers see, null when not mapped
+            std::atomic<bool> referenced{false};     // used since the clock hand last passed
+            std::unique_ptr<const chunk> owner;      // keeps data mapped, only touched under mutex
+        };
+
+        struct retired_chunk {
+            std::unique_ptr<const chunk> data;
+            std::uint64_t epoch; // readers that entered in this epoch or before may still use it
+        };
+
+        std::string directory;
+        std::size_t budget_bytes;
+        std::uint64_t id; // tells caches apart in the per-thread reader lookup
+
+        std::unique_ptr<slot[]> slots; // one per chunk, indexed by id
+        std::vector<std::uint32_t> expected_counts;
+        std::atomic<std::uint64_t> epoch{1}; // 0 is reserved for "not reading"
+
+        // Only touched when paging in or registering a thread, under mutex
+        mutable std::mutex mutex;
+        std::vector<std::uint32_t> resident; // ids of the mapped chunks, in no particular order
+        std::size_t hand = 0;                // clock hand, an index into resident
+        std::size_t resident_bytes = 0;
+        std::vector<retired_chunk> retired;
+        std::vector<std::unique_ptr<reader>> readers;
+
+        static std::uint64_t next_id() {
+            static std::atomic<std::uint64_t> next{1};
+            return next++;
+        }
+
+        // This thread's reader record, registered on first use
+        reader* local_reader() {
+            thread_local std::vector<std::pair<std::uint64_t, reader*>> known;
+            for (const auto& entry : known) {
+                if (entry.first == id) {
+                    return entry.second;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            readers.emplace_back(new reader());
+            known.push_back({ id, readers.back().get() });
+            return readers.back().get();
+        }
+
+        // Unmap retired chunks no reader can still be looking at. Called under mutex.
+        void reclaim() {
+            std::uint64_t oldest = epoch.load();
+            for (const auto& r : readers) {
+                std::uint64_t e = r->epoch.load();
+                if (e != 0 && e < oldest) {
+                    oldest = e;
+                }
+            }
+            retired.erase(std::remove_if(retired.begin(), retired.end(),
+                                         [oldest](const retired_chunk& c) { return c.epoch < oldest; }),
+                          retired.end());
+        }
+
+        std::unique_ptr<const chunk> map_chunk(std::uint32_t id) const {
+            trace_span span("chunk page-in", "io");
+            span.arg("chunk", id);
+
+            std::string path = chunk_path(directory, id);
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("cannot open " + path);
+            }
+
+            struct stat st;
+            std::unique_ptr<chunk> mapped(new chunk());
+            if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(paged_chunk_header)) {
+                mapped->size = (std::size_t)st.st_size;
+                mapped->data = mmap(nullptr, mapped->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            close(fd);
+
+            if (mapped->data == MAP_FAILED) {
+                throw std::runtime_error("cannot map " + path);
+            }
+
+            paged_chunk_header header;
+            std::memcpy(&header, mapped->data, sizeof(header));
+            if (std::memcmp(header.magic, "RTCHUNK\0", 8) != 0 || header.count != expected_counts[id]
+                || mapped->size != sizeof(header) + header.count * sizeof(paged_sphere)) {
+                throw std::runtime_error("corrupt chunk " + path);
+            }
+
+            mapped->count = header.count;
+            mapped->spheres = reinterpret_cast<const paged_sphere*>(static_cast<const char*>(mapped->data) + sizeof(header));
+            return mapped;
+        }
+};
+
+/**
+ * Resident stand-in for one chunk: just its box and id.
+ * Intersecting it pages the chunk in and tests its spheres.
+ */
+class paged_chunk : public hittable {
+    public:
+        paged_chunk(std::uint32_t id, const aabb& box, chunk_cache* cache, const std::vector<shared_ptr<material>>* palette)
+            : id(id), bbox(box), cache(cache), palette(palette) {}
+
+        bool intersect(const ray& r, interval ray_t, hit_query& q) const override {
+            chunk_cache::read_guard guard(*cache);
+            const chunk_cache::chunk* data = cache->acquire(id, guard);
+            bool hit_anything = false;
+
+            for (std::uint64_t i = 0; i < data->count; i++) {
+                const paged_sphere& s = data->spheres[i];
+                vec3 center(s.center[0], s.center[1], s.center[2]);
+                double root;
+                if (sphere::solve(center, s.radius, r, ray_t, root)) {
+                    hit_anything = true;
+                    ray_t.max = root;
+                    q.t = root;
+                    q.object = this;
+                    q.prim = s.material;
+                    q.local = center;
+                }
+            }
+
+            return hit_anything;
+        }
+
+        void interact(const ray& r, const hit_query& q, hit_record& rec) const override {
+            // The chunk may be evicted by now, so intersect() copied what is needed into the
+            // query: the center and the material. The radius is the distance to the hit point.
+            if (q.prim >= palette->size()) {
+                throw std::runtime_error("paged sphere uses an unknown material");
+            }
+            double radius = (r.at(q.t) - q.local).length();
+            sphere::surface(q.local, radius, (*palette)[q.prim].get(), r, q.t, rec);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+    private:
+        std::uint32_t id;
+        aabb bbox;
+        chunk_cache* cache;
+        const std::vector<shared_ptr<material>>* palette;
+};
+
+class paged_scene : public hittable {
+    public:
+        static const std::uint32_t format_version = 2;
+
+        // Spheres wider than this fraction of the whole scene stay resident instead of in a chunk
+        static constexpr double resident_fraction = 0.1;
+
+        // Open the chunked scene in directory, keeping at most budget_bytes of chunks mapped.
+        // palette resolves the material index of every sphere.
+        paged_scene(const std::string& directory, std::size_t budget_bytes, std::vector<shared_ptr<material>> palette)
+            : palette(std::move(palette)), cache(directory, budget_bytes) {
+            std::FILE* f = std::fopen((directory + "/index.bin").c_str(), "rb");
+            if (!f) {
+                throw std::runtime_error("cannot open " + directory + "/index.bin");
+            }
+
+            paged_index_header header;
+            bool ok = read_header(f, header);
+
+            hittable_list objects;
+            std::vector<std::uint32_t> counts;
+            for (std::uint32_t i = 0; ok && i < header.chunk_count; i++) {
+                paged_chunk_info info;
+                ok = std::fread(&info, sizeof(info), 1, f) == 1;
+                if (ok) {
+                    aabb box(vec3(info.bounds_min[0], info.bounds_min[1], info.bounds_min[2]),
+                             vec3(info.bounds_max[0], info.bounds_max[1], info.bounds_max[2]));
+                    objects.add(make_shared<paged_chunk>(i, box, &cache, &this->palette));
+                    counts.push_back(info.count);
+                }
+            }
+            for (std::uint32_t i = 0; ok && i < header.resident_count; i++) {
+                paged_sphere s;
+                ok = std::fread(&s, sizeof(s), 1, f) == 1 && s.material < this->palette.size();
+                if (ok) {
+                    objects.add(make_shared<sphere>(vec3(s.center[0], s.center[1], s.center[2]), s.radius,
+                                                    this->palette[s.material]));
+                }
+            }
+            std::fclose(f);
+
+            if (!ok) {
+                throw std::runtime_error("corrupt " + directory + "/index.bin");
+            }
+
+            cache.set_chunks(std::move(counts));
+            sphere_count = header.sphere_count;
+            top = make_shared<bvh>(objects, 1);
+        }
+
+        bool intersect(const ray& r, interval ray_t, hit_query& q) const override {
+            // One guard for the whole traversal, the chunks' own guards then only nest in it
+            chunk_cache::read_guard guard(cache);
+            return top->intersect(r, ray_t, q);
+        }
+
+        void interact(const ray& r, const hit_query& q, hit_record& rec) const override {
+            q.object->interact(r, q, rec);
+        }
+
+        aabb bounding_box() const override { return top->bounding_box(); }
+
+        std::uint64_t size() const { return sphere_count; }
+        chunk_cache& chunks() { return cache; }
+
+        // Whether directory holds a complete scene of sphere_count spheres written with chunk_size
+        static bool is_written(const std::string& directory, std::uint64_t sphere_count, std::size_t chunk_size) {
+            std::FILE* f = std::fopen((directory + "/index.bin").c_str(), "rb");
+            if (!f) {
+                return false;
+            }
+            paged_index_header header;
+            bool ok = read_header(f, header);
+            std::fclose(f);
+            return ok && header.sphere_count == sphere_count && header.chunk_size == chunk_size;
+        }
+
+        // Split spheres into chunks of at most chunk_size spatially close spheres and write
+        // them to directory. Spheres are reordered in the process.
+        static void write(const std::string& directory, std::vector<paged_sphere>& spheres, std::size_t chunk_size) {
+            chunk_size = std::max<std::size_t>(1, chunk_size);
+
+            // Move the huge spheres to the back, they go into the index
+            aabb scene;
+            for (const auto& s : spheres) {
+                scene = aabb(scene, sphere_box(s));
+            }
+            double limit = resident_fraction * scene.axis_interval(scene.longest_axis()).size();
+            auto chunked_end = std::stable_partition(spheres.begin(), spheres.end(),
+                [limit](const paged_sphere& s) { return 2 * s.radius <= limit; });
+            std::size_t chunked = chunked_end - spheres.begin();
+
+            std::vector<std::pair<std::size_t, std::size_t>> ranges;
+            partition(spheres, 0, chunked, chunk_size, ranges);
+
+            // An old index must not outlive the chunks it describes, even if this write is cut short
+            std::string path = directory + "/index.bin";
+            if (std::remove(path.c_str()) != 0 && errno != ENOENT) {
+                throw std::runtime_error("cannot remove " + path);
+            }
+
+            std::vector<paged_chunk_info> infos;
+            bool ok = true;
+            for (std::uint32_t id = 0; ok && id < ranges.size(); id++) {
+                std::size_t begin = ranges[id].first;
+                std::size_t end = ranges[id].second;
+
+                paged_chunk_info info = {};
+                aabb bounds;
+                for (std::size_t i = begin; i < end; i++) {
+                    bounds = aabb(bounds, sphere_box(spheres[i]));
+                }
+                for (int axis = 0; axis < 3; axis++) {
+                    info.bounds_min[axis] = bounds.axis_interval(axis).min;
+                    info.bounds_max[axis] = bounds.axis_interval(axis).max;
+                }
+                info.count = (std::uint32_t)(end - begin);
+                infos.push_back(info);
+
+                std::string path = chunk_cache::chunk_path(directory, id);
+                std::FILE* f = std::fopen(path.c_str(), "wb");
+                if (!f) {
+                    throw std::runtime_error("cannot write " + path);
+                }
+                paged_chunk_header chunk_header = {};
+                std::memcpy(chunk_header.magic, "RTCHUNK\0", 8);
+                chunk_header.count = end - begin;
+                ok = std::fwrite(&chunk_header, sizeof(chunk_header), 1, f) == 1
+                  && std::fwrite(&spheres[begin], sizeof(paged_sphere), end - begin, f) == end - begin;
+                ok = (std::fclose(f) == 0) && ok;
+            }
+            if (!ok) {
+                throw std::runtime_error("failed writing chunks to " + directory);
+            }
+
+            // The index goes last, to a temporary name and renamed, so an interrupted write
+            // never leaves an index that points at missing or partial chunks
+            paged_index_header header = {};
+            std::memcpy(header.magic, "RTPAGE\0\0", 8);
+            header.version = format_version;
+            header.chunk_count = (std::uint32_t)ranges.size();
+            header.sphere_count = spheres.size();
+            header.chunk_size = (std::uint32_t)chunk_size;
+            header.resident_count = (std::uint32_t)(spheres.size() - chunked);
+
+            std::string temp = path + ".tmp" + std::to_string(getpid());
+            std::FILE* index = std::fopen(temp.c_str(), "wb");
+            if (!index) {
+                throw std::runtime_error("cannot write " + temp);
+            }
+            ok = std::fwrite(&header, sizeof(header), 1, index) == 1
+              && (infos.empty() || std::fwrite(infos.data(), sizeof(paged_chunk_info), infos.size(), index) == infos.size())
+              && (chunked == spheres.size()
+                  || std::fwrite(&spheres[chunked], sizeof(paged_sphere), spheres.size() - chunked, index)
+                     == spheres.size() - chunked);
+            ok = (std::fclose(index) == 0) && ok;
+
+            if (!ok || std::rename(temp.c_str(), path.c_str()) != 0) {
+                std::remove(temp.c_str());
+                throw std::runtime_error("failed writing " + path);
+            }
+        }
+
+    private:
+        std::vector<shared_ptr<material>> palette;
+        mutable chunk_cache cache; // readers register with it, so const traversal still writes to it
+        shared_ptr<bvh> top;
+        std::uint64_t sphere_count = 0;
+
+        static bool read_header(std::FILE* f, paged_index_header& header) {
+            return std::fread(&header, sizeof(header), 1, f) == 1
+                && std::memcmp(header.magic, "RTPAGE\0\0", 8) == 0
+                && header.version == format_version;
+        }
+
+        static aabb sphere_box(const paged_sphere& s) {
+            vec3 c(s.center[0], s.center[1], s.center[2]);
+            vec3 rvec(s.radius, s.radius, s.radius);
+            return aabb(c - rvec, c + rvec);
+        }
+
+        // Median splits along the widest axis, the same way the BVH is built, so every
+        // chunk covers a compact region of space
+        static void partition(std::vector<paged_sphere>& spheres, std::size_t begin, std::size_t end,
+                              std::size_t chunk_size, std::vector<std::pair<std::size_t, std::size_t>>& ranges) {
+            if (end - begin <= chunk_size) {
+                if (end > begin) {
+                    ranges.push_back({ begin, end });
+                }
+                return;
+            }
+
+            aabb centroids;
+            for (std::size_t i = begin; i < end; i++) {
+                vec3 c(spheres[i].center[0], spheres[i].center[1], spheres[i].center[2]);
+                centroids = aabb(centroids, aabb(c, c));
+            }
+            int axis = centroids.longest_axis();
+
+            std::size_t mid = begin + (end - begin) / 2;
+            std::nth_element(spheres.begin() + begin, spheres.begin() + mid, spheres.begin() + end,
+                [axis](const paged_sphere& a, const paged_sphere& b) { return a.center[axis] < b.center[axis]; });
+
+            partition(spheres, begin, mid, chunk_size, ranges);
+            partition(spheres, mid, end, chunk_size, ranges);
+        }
+};
+
+#endif
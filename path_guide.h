@@ -0,0 +1,214 @@
+/**
+ * @file path_guide.h
+ * @brief Learned distribution of incoming light, used to pick bounce directions.
+ *
+ * A simplified SD-tree: space is split by a binary tree, and every leaf holds a
+ * histogram over the sphere of directions saying how much light arrived from where.
+ * While rendering, every diffuse bounce adds the light it brought back into the
+ * histogram of its leaf. Between passes the histograms are turned into sampling
+ * distributions, and leaves that received many samples are split in two so busy
+ * regions get finer.
+ *
+ * The direction histogram uses bins that are uniform in (phi, cos theta), so every
+ * bin covers the same solid angle, 4 pi / bins.
+ */
+
+#ifndef PATH_GUIDE_H
+#define PATH_GUIDE_H
+
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class path_guide {
+    public:
+        static const int bins_phi = 16;
+        static const int bins_cos = 16;
+        static const int bins = bins_phi * bins_cos;
+
+        double mix = 0.5;                  // Chance of sampling the guide instead of the material
+        std::uint32_t split_threshold = 4000; // Samples a leaf may get in one pass before it is split
+        std::size_t max_leaves = 1 << 14;  // Upper bound on leaves, about 2KB each
+
+        explicit path_guide(const aabb& bounds) {
+            for (int axis = 0; axis < 3; axis++) {
+                root_min[axis] = bounds.axis_interval(axis).min;
+                root_max[axis] = bounds.axis_interval(axis).max;
+            }
+            nodes.push_back(node{ -1, bounds.longest_axis(), 0 });
+            leaves.push_back(leaf_data());
+            reset_training();
+        }
+
+        path_guide(const path_guide&) = delete;
+        path_guide& operator=(const path_guide&) = delete;
+
+        // Leaf whose region contains p
+        int find(const vec3& p) const {
+            double lo[3] = { root_min[0], root_min[1], root_min[2] };
+            double hi[3] = { root_max[0], root_max[1], root_max[2] };
+
+            int n = 0;
+            while (nodes[n].child >= 0) {
+                int axis = nodes[n].axis;
+                double mid = 0.5 * (lo[axis] + hi[axis]);
+                if (p[axis] < mid) {
+                    hi[axis] = mid;
+                    n = nodes[n].child;
+                } else {
+                    lo[axis] = mid;
+                    n = nodes[n].child + 1;
+                }
+            }
+            return nodes[n].leaf;
+        }
+
+        // Whether the leaf has learned anything it can be sampled from
+        bool usable(int leaf) const {
+            return leaves[leaf].usable;
+        }
+
+        // Unit direction drawn from the leaf's distribution
+        vec3 sample(int leaf) const {
+            const auto& cdf = leaves[leaf].cdf;
+            int bin = (int)(std::upper_bound(cdf.begin(), cdf.end(), (float)random_double()) - cdf.begin());
+            bin = std::min(bin, bins - 1);
+
+            double u = ((bin % bins_phi) + random_double()) / bins_phi;
+            double v = ((bin / bins_phi) + random_double()) / bins_cos;
+
+            double cos_theta = 2 * v - 1;
+            double sin_theta = sqrt(fmax(0.0, 1 - cos_theta * cos_theta));
+            double phi = 2 * pi * u - pi;
+            return vec3(sin_theta * cos(phi), cos_theta, sin_theta * sin(phi));
+        }
+
+        // Solid angle density of sample() producing dir
+        double pdf(int leaf, const vec3& dir) const {
+            const auto& cdf = leaves[leaf].cdf;
+            int bin = bin_of(dir);
+            double p = cdf[bin] - (bin > 0 ? cdf[bin - 1] : 0.0f);
+            return p * bins / (4 * pi);
+        }
+
+        // Add an estimate of the light arriving at leaf from dir. Safe to call from any thread.
+        void record(int leaf, const vec3& dir, double value) {
+            if (!(value > 0) || std::isinf(value)) {
+                return;
+            }
+            atomic_add(energy[leaf * bins + bin_of(dir)], (float)value);
+            sample_count[leaf].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Turn what was recorded during the last pass into the sampling distributions and
+        // refine the tree. Must not run while any thread is rendering.
+        void refresh() {
+            std::size_t old_leaves = leaves.size();
+
+            for (std::size_t l = 0; l < old_leaves; l++) {
+                double total = 0.0;
+                for (int b = 0; b < bins; b++) {
+                    total += energy[l * bins + b].load(std::memory_order_relaxed);
+                }
+                if (total <= 0.0) {
+                    continue; // keep whatever the leaf learned before
+                }
+
+                auto& cdf = leaves[l].cdf;
+                double running = 0.0;
+                for (int b = 0; b < bins; b++) {
+                    running += energy[l * bins + b].load(std::memory_order_relaxed);
+                    cdf[b] = (float)(running / total);
+                }
+                cdf[bins - 1] = 1.0f;
+                leaves[l].usable = true;
+            }
+
+            // Nodes can be appended while splitting, so walk by index over the current ones
+            std::size_t old_nodes = nodes.size();
+            for (std::size_t n = 0; n < old_nodes; n++) {
+                if (nodes[n].child < 0) {
+                    split((int)n, sample_count[nodes[n].leaf].load(std::memory_order_relaxed));
+                }
+            }
+
+            reset_training();
+        }
+
+        std::size_t leaf_count() const { return leaves.size(); }
+
+    private:
+        struct node {
+            int child; // first of two children (the second is child + 1), -1 for a leaf
+            int axis;  // axis this node's region is halved along
+            int leaf;  // leaf data index, only meaningful for leaves
+        };
+
+        struct leaf_data {
+            std::vector<float> cdf = std::vector<float>(bins, 0.0f);
+            bool usable = false;
+        };
+
+        double root_min[3];
+        double root_max[3];
+        std::vector<node> nodes;
+        std::vector<leaf_data> leaves;
+
+        // Training data for the pass in progress, one row of bins per leaf
+        std::unique_ptr<std::atomic<float>[]> energy;
+        std::unique_ptr<std::atomic<std::uint32_t>[]> sample_count;
+
+        static int bin_of(const vec3& dir) {
+            double len = dir.length();
+            double cos_theta = dir.y() / len;
+            double u = (atan2(dir.z(), dir.x()) + pi) / (2 * pi);
+            double v = (cos_theta + 1) / 2;
+            int bu = std::min(std::max((int)(u * bins_phi), 0), bins_phi - 1);
+            int bv = std::min(std::max((int)(v * bins_cos), 0), bins_cos - 1);
+            return bv * bins_phi + bu;
+        }
+
+        static void atomic_add(std::atomic<float>& target, float value) {
+            float current = target.load(std::memory_order_relaxed);
+            while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {
+            }
+        }
+
+        // Halve node n until each part is expected to stay under the threshold.
+        // Both halves start out with the parent's distribution.
+        void split(int n, std::uint32_t samples) {
+            if (samples <= split_threshold || leaves.size() >= max_leaves) {
+                return;
+            }
+
+            int leaf = nodes[n].leaf;
+            int axis = nodes[n].axis;
+            int child = (int)nodes.size();
+            int next_axis = (axis + 1) % 3;
+
+            leaves.push_back(leaves[leaf]);
+            nodes.push_back(node{ -1, next_axis, leaf });
+            nodes.push_back(node{ -1, next_axis, (int)leaves.size() - 1 });
+            nodes[n].child = child;
+
+            split(child, samples / 2);
+            split(child + 1, samples / 2);
+        }
+
+        void reset_training() {
+            energy.reset(new std::atomic<float>[leaves.size() * bins]);
+            sample_count.reset(new std::atomic<std::uint32_t>[leaves.size()]);
+            for (std::size_t i = 0; i < leaves.size() * bins; i++) {
+                energy[i].store(0.0f, std::memory_order_relaxed);
+            }
+            for (std::size_t i = 0; i < leaves.size(); i++) {
+                sample_count[i].store(0, std::memory_order_relaxed);
+            }
+        }
+};
+
+#endif
@@ -11,15 +11,15 @@
 
 #include "vec3.h"
 
-class ray : public vec3 {
+class ray {
     public:
 
         ray() {}
         ray(const vec3& origin, const vec3& direction) : orig(origin), dir(direction) {}
 
         // getters return immutable references to the objects
-        vec3 origin() const { return orig; }
-        vec3 direction() const { return dir; }
+        const vec3& origin() const { return orig; }
+        const vec3& direction() const { return dir; }
 
         // return point *at* parameter t
         vec3 at(double t) const {
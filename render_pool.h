@@ -0,0 +1,134 @@
+/**
+ * @file render_pool.h
+ * @brief Render threads that live as long as the pool, not as long as one render.
+ *
+ * Starting threads per render is cheap next to the render itself, but it gives every
+ * render (every server job, every guided pass) a fresh set of threads. In a trace that
+ * means a new row per thread per render, which hides how busy each worker was over time.
+ * The pool starts its workers once and hands each run() to all of them.
+ */
+
+#ifndef RENDER_POOL_H
+#define RENDER_POOL_H
+
+#include "trace.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class render_pool {
+    public:
+        // threads counts the calling thread too, 0 means one per hardware thread
+        explicit render_pool(int threads) {
+            if (threads <= 0) {
+                threads = (int)std::thread::hardware_concurrency();
+            }
+            thread_count = std::max(1, threads);
+
+            for (int t = 1; t < thread_count; t++) {
+                workers.emplace_back([this, t]() {
+                    tracer::instance().name_thread("render worker " + std::to_string(t));
+                    work();
+                });
+            }
+        }
+
+        ~render_pool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+
+        render_pool(const render_pool&) = delete;
+        render_pool& operator=(const render_pool&) = delete;
+
+        int size() const { return thread_count; }
+
+        // Run task on every worker and on the calling thread, and return once all of them
+        // are done. The first exception thrown by any of them is rethrown here.
+        // Calls from different threads take turns.
+        void run(const std::function<void()>& task) {
+            std::lock_guard<std::mutex> turn(run_mutex);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                current = &task;
+                failure = nullptr;
+                busy = thread_count - 1;
+                generation++;
+            }
+            wake.notify_all();
+
+            execute(task); // the calling thread works too
+
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [&]() { return busy == 0; });
+            current = nullptr;
+            if (failure) {
+                std::exception_ptr rethrow = failure;
+                failure = nullptr;
+                std::rethrow_exception(rethrow);
+            }
+        }
+
+    private:
+        int thread_count = 1;
+        std::vector<std::thread> workers;
+
+        std::mutex run_mutex; // one run() at a time
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        const std::function<void()>* current = nullptr;
+        std::exception_ptr failure; // first exception of the current run
+        int busy = 0;               // workers still on the current run
+        long generation = 0;        // bumped per run, so a worker never runs the same task twice
+        bool stopping = false;
+
+        void execute(const std::function<void()>& task) {
+            try {
+                task();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+            }
+        }
+
+        void work() {
+            long seen = 0;
+            while (true) {
+                const std::function<void()>* task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [&]() { return stopping || generation != seen; });
+                    if (stopping) {
+                        return;
+                    }
+                    seen = generation;
+                    task = current;
+                }
+
+                execute(*task);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--busy == 0) {
+                    done.notify_one();
+                }
+            }
+        }
+};
+
+#endif
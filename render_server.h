@@ -0,0 +1,311 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include "common.h"
+#include "camera.h"
+#include "json.h"
+#include "render_pool.h"
+#include "trace.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+
+/**
+ * Long-running render mode.
+ * Scenes are built once and stay resident, so every job only pays for its own pixels.
+ *
+ * Jobs arrive one JSON object per line (stdin, or a local socket piped in with e.g.
+ * `socat UNIX-LISTEN:/tmp/rt.sock -`):
+ *
+ *   {"id": "a", "priority": 2, "output": "a.ppm", "image_width": 800, "samples_per_pixel": 50,
+ *    "lookfrom": [-2,2,1], "lookat": [0,0,-1], "vup": [0,1,0], "vertical_fov": 20}
+ *
+ * Only "output" is required, anything else falls back to the scene's camera.
+ * Jobs with a higher priority run first, equal priorities run in arrival order.
+ * Each job is rendered by all render threads (one render_pool for the whole run), and one
+ * JSON line with its latency and throughput is written back per job.
+ */
+
+class render_server {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        int thread_count = 0; // Render threads per job, 0 means one per hardware thread
+
+        // Build a scene and keep it resident under name. base_cam is the camera jobs start from.
+        void add_scene(const std::string& name, std::function<shared_ptr<hittable>()> build, const camera& base_cam) {
+            auto start = clock::now();
+            resident_scene scene;
+            scene.world = build();
+            scene.cam = base_cam;
+            scenes[name] = scene;
+            setup_ms += ms_since(start);
+        }
+
+        // Serve jobs from in until it is closed, writing one response line per job to out
+        void run(std::istream& in, std::ostream& out) {
+            response_out = &out;
+            auto served_since = clock::now();
+            pool = make_shared<render_pool>(thread_count); // the same threads render every job
+
+            std::thread reader([&]() {
+                tracer::instance().name_thread("job reader");
+                read_jobs(in);
+            });
+
+            while (true) {
+                render_job job;
+                {
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    queue_ready.wait(lock, [&]() { return !jobs.empty() || input_closed; });
+                    if (jobs.empty()) {
+                        break;
+                    }
+                    job = jobs.top();
+                    jobs.pop();
+                }
+                run_job(job);
+            }
+
+            reader.join();
+
+            double served_ms = ms_since(served_since);
+            std::clog << "Server: " << jobs_done << " jobs, " << jobs_failed << " failed\n"
+                      << "  scene setup (paid once): " << setup_ms << " ms\n"
+                      << "  render time:             " << render_ms_total << " ms\n"
+                      << "  mean job latency:        " << (jobs_done ? latency_ms_total / jobs_done : 0.0) << " ms\n"
+                      << "  throughput:              " << (served_ms > 0 ? 1000.0 * jobs_done / served_ms : 0.0)
+                      << " jobs/s, " << (render_ms_total > 0 ? 1000.0 * samples_total / render_ms_total : 0.0)
+                      << " samples/s\n";
+        }
+
+    private:
+        struct resident_scene {
+            shared_ptr<hittable> world;
+            camera cam;
+        };
+
+        struct render_job {
+            std::string id;
+            int priority = 0;
+            long sequence = 0;       // arrival order, breaks priority ties
+            json_value request;
+            clock::time_point queued;
+
+            // std::priority_queue keeps the *largest* element on top
+            bool operator<(const render_job& other) const {
+                if (priority != other.priority) {
+                    return priority < other.priority;
+                }
+                return sequence > other.sequence;
+            }
+        };
+
+        std::map<std::string, resident_scene> scenes;
+        double setup_ms = 0.0;
+        shared_ptr<render_pool> pool;
+
+        std::priority_queue<render_job> jobs;
+        std::mutex queue_mutex;
+        std::condition_variable queue_ready;
+        bool input_closed = false;
+        long next_sequence = 0;
+
+        std::ostream* response_out = nullptr;
+        std::mutex response_mutex;
+
+        // Only touched by the thread running jobs
+        int jobs_done = 0;
+        int jobs_failed = 0;
+        double render_ms_total = 0.0;
+        double latency_ms_total = 0.0;
+        double samples_total = 0.0;
+
+        static double ms_since(clock::time_point start) {
+            return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        }
+
+        static std::string quoted(const std::string& s) {
+            std::string out = "\"";
+            for (char c : s) {
+                if (c == '"' || c == '\\') out += '\\';
+                out += c;
+            }
+            return out + "\"";
+        }
+
+        void respond(const std::string& line) {
+            std::lock_guard<std::mutex> lock(response_mutex);
+            *response_out << line << std::endl;
+        }
+
+        void respond_error(const std::string& id, const std::string& message) {
+            respond("{\"id\":" + quoted(id) + ",\"status\":\"error\",\"error\":" + quoted(message) + "}");
+        }
+
+        void read_jobs(std::istream& in) {
+            std::string line;
+            while (std::getline(in, line)) {
+                if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                    continue;
+                }
+
+                render_job job;
+                try {
+                    job.request = json_value::parse(line);
+                    if (job.request.type != json_value::object) {
+                        throw std::runtime_error("job must be a JSON object");
+                    }
+                } catch (const std::exception& e) {
+                    respond_error("", e.what());
+                    continue;
+                }
+
+                if (job.request.has("id")) {
+                    const auto& id = job.request["id"];
+                    if (id.type == json_value::string) {
+                        job.id = id.str;
+                    } else {
+                        std::ostringstream s;
+                        s << id.num;
+                        job.id = s.str();
+                    }
+                }
+                if (job.request.has("priority")) {
+                    try {
+                        job.priority = (int)to_number(job.request["priority"], "priority", -1e6, 1e6);
+                    } catch (const std::exception& e) {
+                        respond_error(job.id, e.what());
+                        continue;
+                    }
+                }
+                job.queued = clock::now();
+
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    job.sequence = next_sequence++;
+                    jobs.push(job);
+                }
+                queue_ready.notify_one();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                input_closed = true;
+            }
+            queue_ready.notify_one();
+        }
+
+        // A number field within [lo, hi], anything else is rejected before it can reach a cast
+        static double to_number(const json_value& v, const char* name, double lo, double hi) {
+            if (v.type != json_value::number || !std::isfinite(v.num) || v.num < lo || v.num > hi) {
+                std::ostringstream message;
+                message << "\"" << name << "\" must be a number between " << lo << " and " << hi;
+                throw std::runtime_error(message.str());
+            }
+            return v.num;
+        }
+
+        static vec3 to_vec3(const json_value& v, const char* name) {
+            if (v.type != json_value::array || v.items.size() != 3) {
+                throw std::runtime_error(std::string("\"") + name + "\" must be an array of 3 numbers");
+            }
+            const double limit = 1e9;
+            return vec3(to_number(v.items[0], name, -limit, limit),
+                        to_number(v.items[1], name, -limit, limit),
+                        to_number(v.items[2], name, -limit, limit));
+        }
+
+        // Apply the camera fields present in the request on top of the scene's camera
+        static void apply_camera(const json_value& req, camera& cam) {
+            if (req.has("image_width"))       cam.image_width = (int)to_number(req["image_width"], "image_width", 1, 16384);
+            if (req.has("aspect_ratio"))      cam.aspect_ratio = to_number(req["aspect_ratio"], "aspect_ratio", 1e-3, 1e3);
+            if (req.has("image_height"))      cam.requested_height = (int)to_number(req["image_height"], "image_height", 1, 16384);
+            if (req.has("samples_per_pixel")) cam.samples_per_pixel = (int)to_number(req["samples_per_pixel"], "samples_per_pixel", 1, 1e6);
+            if (req.has("max_depth"))         cam.max_depth = (int)to_number(req["max_depth"], "max_depth", 1, 1000);
+            if (req.has("vertical_fov"))      cam.vertical_fov = to_number(req["vertical_fov"], "vertical_fov", 1e-3, 179);
+            if (req.has("lookfrom"))          cam.lookfrom = to_vec3(req["lookfrom"], "lookfrom");
+            if (req.has("lookat"))            cam.lookat = to_vec3(req["lookat"], "lookat");
+            if (req.has("vup"))               cam.vup = to_vec3(req["vup"], "vup");
+            if (req.has("defocus_angle"))     cam.defocus_angle = to_number(req["defocus_angle"], "defocus_angle", 0, 179);
+            if (req.has("focus_dist"))        cam.focus_dist = to_number(req["focus_dist"], "focus_dist", 1e-6, 1e9);
+
+            double height = cam.requested_height > 0 ? cam.requested_height : cam.image_width / cam.aspect_ratio;
+            if (height > 16384) {
+                throw std::runtime_error("image height must be at most 16384");
+            }
+
+            // The camera basis is built from lookfrom - lookat and vup, so both must give a direction
+            vec3 forward = cam.lookfrom - cam.lookat;
+            if (forward.length() < 1e-9) {
+                throw std::runtime_error("lookfrom and lookat must differ");
+            }
+            if (cam.vup.length() < 1e-9
+                || cross_product(cam.vup, forward).length() < 1e-9 * cam.vup.length() * forward.length()) {
+                throw std::runtime_error("vup must be nonzero and not parallel to the view direction");
+            }
+        }
+
+        void run_job(const render_job& job) {
+            auto start = clock::now();
+            double queue_ms = std::chrono::duration<double, std::milli>(start - job.queued).count();
+
+            trace_span span("job", "server");
+            span.arg("priority", job.priority);
+            span.arg("sequence", job.sequence);
+
+            try {
+                const auto& req = job.request;
+                if (!req.has("output") || req["output"].type != json_value::string) {
+                    throw std::runtime_error("missing \"output\" path");
+                }
+
+                std::string scene_name = req.has("scene") ? req["scene"].str : "default";
+                auto found = scenes.find(scene_name);
+                if (found == scenes.end()) {
+                    throw std::runtime_error("unknown scene " + scene_name);
+                }
+
+                camera cam = found->second.cam;
+                apply_camera(req, cam);
+                cam.thread_count = thread_count;
+                cam.pool = pool;
+                cam.show_progress = false;
+
+                std::ofstream file(req["output"].str);
+                if (!file) {
+                    throw std::runtime_error("cannot open " + req["output"].str);
+                }
+                cam.render(*found->second.world, file);
+
+                double render_ms = ms_since(start);
+                double samples = double(cam.image_width) * cam.height() * cam.samples_per_pixel;
+
+                jobs_done++;
+                render_ms_total += render_ms;
+                latency_ms_total += queue_ms + render_ms;
+                samples_total += samples;
+
+                std::ostringstream line;
+                line << "{\"id\":" << quoted(job.id) << ",\"status\":\"done\""
+                     << ",\"queue_ms\":" << queue_ms
+                     << ",\"render_ms\":" << render_ms
+                     << ",\"latency_ms\":" << queue_ms + render_ms
+                     << ",\"samples_per_sec\":" << (render_ms > 0 ? 1000.0 * samples / render_ms : 0.0) << "}";
+                respond(line.str());
+            } catch (const std::exception& e) {
+                jobs_failed++;
+                respond_error(job.id, e.what());
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "common.h"
+#include "camera.h"
+#include "diffuse.h"
+#include "metal.h"
+#include "dielectric.h"
+#include "paged_geometry.h"
+
+#include <vector>
+
+/**
+ * Scenes that can be rendered, together with the camera that frames them.
+ * Kept apart from main.cpp so the one-shot render and the render server
+ * build exactly the same world.
+ */
+
+inline hittable_list default_scene() {
+    hittable_list world;
+    auto material_ground = make_shared<diffuse>(color(0.8, 0.8, 0.0));
+    auto material_center = make_shared<diffuse>(color(0.1, 0.2, 0.5));
+    auto material_left   = make_shared<dielectric>(1.5); // Air to Glass
+    auto material_bubble = make_shared<dielectric>(1.00 / 1.5); // Glass to Air
+    auto material_right  = make_shared<metal>(color(0.8, 0.6, 0.2), 1.0);
+
+    world.add(make_shared<sphere>(vec3( 0.0, -100.5, -1.0), 100.0, material_ground));
+    world.add(make_shared<sphere>(vec3( 0.0,    0.0, -1.2),   0.5, material_center));
+    world.add(make_shared<sphere>(vec3(-1.0,    0.0, -1.0),   0.5, material_left));
+    world.add(make_shared<sphere>(vec3(-1.0,    0.0, -1.0),   0.4, material_bubble));
+    world.add(make_shared<sphere>(vec3( 1.0,    0.0, -1.0),   0.5, material_right));
+
+    return world;
+}
+
+inline camera default_camera() {
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.max_depth = 10;
+    cam.samples_per_pixel = 10;
+    cam.vertical_fov = 20.0;
+    cam.lookfrom = vec3(-2,2,1);
+    cam.lookat = vec3(0,0,-1);
+    cam.vup = vec3(0,1,0);
+
+    cam.defocus_angle = 10.0;
+    cam.focus_dist = 3.4;
+
+    return cam;
+}
+
+// A large field of small random spheres on a ground sphere, as plain records for
+// paged_scene. palette receives the materials the records refer to; it is the same
+// on every call, so records written by an earlier run stay valid.
+inline std::vector<paged_sphere> sphere_field(std::size_t count, std::vector<shared_ptr<material>>& palette) {
+    palette.clear();
+    palette.push_back(make_shared<diffuse>(color(0.5, 0.5, 0.5))); // ground
+    palette.push_back(make_shared<dielectric>(1.5));
+    palette.push_back(make_shared<diffuse>(color(0.7, 0.2, 0.2)));
+    palette.push_back(make_shared<diffuse>(color(0.2, 0.6, 0.3)));
+    palette.push_back(make_shared<diffuse>(color(0.1, 0.2, 0.5)));
+    palette.push_back(make_shared<diffuse>(color(0.8, 0.8, 0.3)));
+    palette.push_back(make_shared<metal>(color(0.8, 0.6, 0.2), 0.1));
+    palette.push_back(make_shared<metal>(color(0.7, 0.7, 0.8), 0.4));
+
+    std::vector<paged_sphere> spheres;
+    spheres.reserve(count + 1);
+    spheres.push_back(paged_sphere{ { 0, -1000, 0 }, 1000, 0, 0 });
+
+    // Lay the spheres out on a square grid with some jitter
+    int side = (int)std::ceil(std::sqrt((double)count));
+    double spacing = 0.5;
+    for (std::size_t n = 0; n < count; n++) {
+        double x = ((int)(n % side) - side / 2) * spacing + 0.3 * spacing * random_double();
+        double z = ((int)(n / side) - side / 2) * spacing + 0.3 * spacing * random_double();
+        std::uint32_t mat = 1 + (std::uint32_t)(random_double() * (palette.size() - 1));
+        spheres.push_back(paged_sphere{ { x, 0.1, z }, 0.1, mat, 0 });
+    }
+
+    return spheres;
+}
+
+#endif
@@ -8,9 +8,31 @@
 class sphere : public hittable {
     public:
         sphere() {}
-        sphere(vec3 center, double radius, shared_ptr<material> mat) : center(center), radius(fmax(0, radius)), mat(mat) {}
+        sphere(vec3 center, double radius, shared_ptr<material> mat) : center(center), radius(fmax(0, radius)), mat(mat) {
+            auto rvec = vec3(this->radius, this->radius, this->radius);
+            bbox = aabb(center - rvec, center + rvec);
+        }
+
+        bool intersect(const ray& r, interval ray_t, hit_query& q) const override {
+            double root;
+            if (!solve(center, radius, r, ray_t, root)) {
+                return false;
+            }
+
+            q.t = root;
+            q.object = this;
+            q.prim = 0;
 
-        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            return true;
+        }
+
+        void interact(const ray& r, const hit_query& q, hit_record& rec) const override {
+            surface(center, radius, mat.get(), r, q.t, rec);
+        }
+
+        // Find the nearest t in ray_t where r crosses the sphere.
+        // Static so spheres stored as plain data (see paged_geometry.h) share the math.
+        static bool solve(const vec3& center, double radius, const ray& r, interval ray_t, double& root) {
             vec3 oc = center - r.origin();
             // auto a = dot(r.direction(), r.direction());
             auto a = r.direction().length_squared();
@@ -22,52 +44,58 @@ class sphere : public hittable {
 
             if (discriminant < 0) {
                 return false;
-            } else {
-                // return the solution to the quadratic equation
-                // which represents the intersection point of the ray with the sphere
-                // return (-b - sqrt(discriminant)) / (2.0 * a);
-                auto root = (h - sqrt(discriminant)) / a;
+            }
+
+            // return the solution to the quadratic equation
+            // which represents the intersection point of the ray with the sphere
+            // return (-b - sqrt(discriminant)) / (2.0 * a);
+            auto sqrtd = sqrt(discriminant);
+            root = (h - sqrtd) / a;
+
+            // if (root <= t_min || root >= t_max) {
+            if (!ray_t.surrounds(root)) {
+                // try the other root
+                root = (h + sqrtd) / a;
 
                 // if (root <= t_min || root >= t_max) {
                 if (!ray_t.surrounds(root)) {
-                    // try the other root
-                    root = (h + sqrt(discriminant)) / a;
-
-                    // if (root <= t_min || root >= t_max) {
-                    if (!ray_t.surrounds(root)) {
-                        return false;
-                    }
+                    return false;
                 }
+            }
 
-                vec3 outward_normal = unit_vector(r.at(root) - center);
-                vec3 normal;
-                bool front_face = false;
-
-                // determine normal vector direction
-                if (dot(r.direction(), outward_normal) > 0.0) {
-                    // ray is inside the sphere
-                    normal = -outward_normal;
-                    front_face = false;
-                } else {
-                    // ray is outside the sphere
-                    normal = outward_normal;
-                    front_face = true;
-                }
+            return true;
+        }
+
+        // Fill in the surface interaction at parameter t
+        static void surface(const vec3& center, double radius, const material* mat,
+                            const ray& r, double t, hit_record& rec) {
+            rec.t = t;
+            rec.p = r.at(t);
 
-                rec.t = root;
-                rec.normal = normal;
-                rec.p = r.at(rec.t);
-                rec.front_face = front_face;
-                rec.mat = mat;
+            // dividing by the radius is cheaper than normalizing and gives the same unit vector
+            vec3 outward_normal = (rec.p - center) / radius;
 
-                return true;
+            // determine normal vector direction
+            if (dot(r.direction(), outward_normal) > 0.0) {
+                // ray is inside the sphere
+                rec.normal = -outward_normal;
+                rec.front_face = false;
+            } else {
+                // ray is outside the sphere
+                rec.normal = outward_normal;
+                rec.front_face = true;
             }
+
+            rec.mat = mat;
         }
 
+        aabb bounding_box() const override { return bbox; }
+
     private:
         vec3 center;
         double radius;
         shared_ptr<material> mat;
+        aabb bbox;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,184 @@
+/**
+ * @file trace.h
+ * @brief Optional timeline of what every thread was doing, for chrome://tracing or Perfetto.
+ *
+ * Code marks a span of work by creating a trace_span on the stack:
+ *
+ *   trace_span span("tile", "render");
+ *   span.arg("x", x0);
+ *
+ * While tracing is off, a span costs one relaxed atomic load. While it is on, each thread
+ * appends to its own buffer, so threads never wait on each other. At the end everything
+ * is written out as Chrome trace-event JSON.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class tracer {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        struct event {
+            const char* name;
+            const char* category;
+            std::int64_t start_us;
+            std::int64_t duration_us;
+            int arg_count;
+            const char* arg_names[4];
+            std::int64_t arg_values[4];
+        };
+
+        static tracer& instance() {
+            static tracer the_tracer;
+            return the_tracer;
+        }
+
+        bool enabled() const {
+            return active.load(std::memory_order_relaxed);
+        }
+
+        void start() {
+            epoch = clock::now();
+            active.store(true, std::memory_order_relaxed);
+        }
+
+        std::int64_t now_us() const {
+            return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - epoch).count();
+        }
+
+        void record(const event& e) {
+            thread_buffer& buffer = local_buffer();
+            std::lock_guard<std::mutex> lock(buffer.mutex); // only contended while write() runs
+            buffer.events.push_back(e);
+        }
+
+        // Label the calling thread in the viewer
+        void name_thread(const std::string& name) {
+            if (!enabled()) {
+                return;
+            }
+            thread_buffer& buffer = local_buffer();
+            std::lock_guard<std::mutex> lock(buffer.mutex);
+            buffer.name = name;
+        }
+
+        // Stop recording and write every thread's events to path. Returns false if the file can't be written.
+        bool write(const std::string& path) {
+            active.store(false, std::memory_order_relaxed);
+
+            std::ofstream out(path);
+            if (!out) {
+                return false;
+            }
+
+            out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+            bool first = true;
+
+            std::lock_guard<std::mutex> lock(buffers_mutex);
+            for (const auto& buffer : buffers) {
+                std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+
+                out << (first ? "" : ",\n")
+                    << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+                    << ",\"args\":{\"name\":\"" << buffer->name << "\"}}";
+                first = false;
+
+                for (const auto& e : buffer->events) {
+                    out << ",\n{\"name\":\"" << e.name << "\",\"cat\":\"" << e.category
+                        << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+                        << ",\"ts\":" << e.start_us << ",\"dur\":" << e.duration_us;
+                    if (e.arg_count > 0) {
+                        out << ",\"args\":{";
+                        for (int i = 0; i < e.arg_count; i++) {
+                            out << (i ? "," : "") << "\"" << e.arg_names[i] << "\":" << e.arg_values[i];
+                        }
+                        out << "}";
+                    }
+                    out << "}";
+                }
+            }
+
+            out << "\n]}\n";
+            return (bool)out;
+        }
+
+    private:
+        struct thread_buffer {
+            int tid;
+            std::string name;
+            std::vector<event> events;
+            std::mutex mutex;
+        };
+
+        std::atomic<bool> active{false};
+        clock::time_point epoch = clock::now();
+
+        // Buffers are owned here rather than by their threads, so the events of
+        // threads that already finished are still around when writing
+        std::mutex buffers_mutex;
+        std::vector<std::unique_ptr<thread_buffer>> buffers;
+
+        tracer() {}
+
+        thread_buffer& local_buffer() {
+            static thread_local thread_buffer* mine = nullptr;
+            if (!mine) {
+                std::lock_guard<std::mutex> lock(buffers_mutex);
+                buffers.emplace_back(new thread_buffer());
+                mine = buffers.back().get();
+                mine->tid = (int)buffers.size();
+                mine->name = "thread " + std::to_string(mine->tid);
+                mine->events.reserve(1024);
+            }
+            return *mine;
+        }
+};
+
+// Records the time between its construction and destruction as one event.
+// name, category and argument names must be string literals (only the pointers are kept).
+class trace_span {
+    public:
+        trace_span(const char* name, const char* category) {
+            if (tracer::instance().enabled()) {
+                recording = true;
+                e.name = name;
+                e.category = category;
+                e.arg_count = 0;
+                e.start_us = tracer::instance().now_us();
+            }
+        }
+
+        ~trace_span() {
+            if (recording) {
+                e.duration_us = tracer::instance().now_us() - e.start_us;
+                tracer::instance().record(e);
+            }
+        }
+
+        trace_span(const trace_span&) = delete;
+        trace_span& operator=(const trace_span&) = delete;
+
+        void arg(const char* name, std::int64_t value) {
+            if (recording && e.arg_count < 4) {
+                e.arg_names[e.arg_count] = name;
+                e.arg_values[e.arg_count] = value;
+                e.arg_count++;
+            }
+        }
+
+    private:
+        bool recording = false;
+        tracer::event e;
+};
+
+#endif